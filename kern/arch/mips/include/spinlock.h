@@ -43,6 +43,9 @@ typedef unsigned spinlock_data_t;
 void spinlock_data_set(volatile spinlock_data_t *sd, unsigned val);
 spinlock_data_t spinlock_data_get(volatile spinlock_data_t *sd);
 spinlock_data_t spinlock_data_testandset(volatile spinlock_data_t *sd);
+spinlock_data_t spinlock_data_swap(volatile spinlock_data_t *sd, unsigned val);
+spinlock_data_t spinlock_data_cas(volatile spinlock_data_t *sd,
+				  unsigned oldval, unsigned newval);
 
 ////////////////////////////////////////////////////////////
 
@@ -93,5 +96,62 @@ spinlock_data_testandset(volatile spinlock_data_t *sd)
 	return x;
 }
 
+SPINLOCK_INLINE
+spinlock_data_t
+spinlock_data_swap(volatile spinlock_data_t *sd, unsigned val)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	/*
+	 * Atomic exchange: the same LL/SC as above, but retried until
+	 * the SC goes through, and storing VAL. Returns the old value.
+	 */
+	do {
+		y = val;
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			"ll %0, 0(%2);"		/*   x = *sd */
+			"sc %1, 0(%2);"		/*   *sd = y; y = success? */
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "+r" (y) : "r" (sd));
+	} while (y == 0);
+	return x;
+}
+
+SPINLOCK_INLINE
+spinlock_data_t
+spinlock_data_cas(volatile spinlock_data_t *sd,
+		  unsigned oldval, unsigned newval)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	/*
+	 * Compare-and-swap: store NEWVAL only if the word holds OLDVAL.
+	 * Returns the value found, so the store happened if that's
+	 * OLDVAL. If the word differs we skip the SC; if the SC fails
+	 * we try again.
+	 */
+	while (1) {
+		y = newval;
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			"ll %0, 0(%2);"		/*   x = *sd */
+			"bne %0, %3, 1f;"	/*   if (x != oldval) skip */
+			"sc %1, 0(%2);"		/*   *sd = y; y = success? */
+			"1:"
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "+r" (y) : "r" (sd), "r" (oldval));
+		if (x != oldval || y != 0) {
+			return x;
+		}
+	}
+}
+
 
 #endif /* _MIPS_SPINLOCK_H_ */
@@ -66,7 +66,7 @@
  * a valid address, and will make a *huge* mess if you scribble on it.
  */
 #define PADDR_TO_KVADDR(paddr) ((paddr)+MIPS_KSEG0)
-#define KVADDR_TO_PADDR(kvaddr) ((kvaddr)-MIPS_KSEG0);
+#define KVADDR_TO_PADDR(kvaddr) ((kvaddr)-MIPS_KSEG0)
 
 /*
  * The top of user space. (Actually, the address immediately above the
@@ -218,6 +218,12 @@ mips_trap(struct trapframe *tf)
 		mainbus_interrupt(tf);
 
 		if (doadjust) {
+			/*
+			 * We interrupted code that had interrupts on,
+			 * so it holds no spinlocks and may be preempted.
+			 */
+			thread_preempt_intr();
+
 			KASSERT(curthread->t_curspl == IPL_HIGH);
 			KASSERT(curthread->t_iplhigh_count == 1);
 			curthread->t_iplhigh_count--;
@@ -108,6 +108,29 @@ syscall(struct trapframe *tf)
 		err = sys___time((userptr_t)tf->tf_a0,
 				 (userptr_t)tf->tf_a1);
 		break;
+
+	    case SYS_nanosleep:
+		err = sys_nanosleep((userptr_t)tf->tf_a0,
+				    (userptr_t)tf->tf_a1);
+		break;
+
+	    case SYS_setaffinity:
+		err = sys_setaffinity((unsigned)tf->tf_a0);
+		break;
+
+	    case SYS_getaffinity:
+		err = sys_getaffinity((userptr_t)tf->tf_a0);
+		break;
+
+	    case SYS_setpriority:
+		err = sys_setpriority((int)tf->tf_a0, (pid_t)tf->tf_a1,
+				      (int)tf->tf_a2);
+		break;
+
+	    case SYS_getpriority:
+		err = sys_getpriority((int)tf->tf_a0, (pid_t)tf->tf_a1,
+				      (int *)&retval);
+		break;
 #ifdef UW
 	case SYS_write:
 	  err = sys_write((int)tf->tf_a0,
@@ -34,10 +34,13 @@
 #include <spinlock.h>
 #include <proc.h>
 #include <current.h>
+#include <cpu.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <coremap.h>
+#include <shrinker.h>
+#include <pageout.h>
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -68,27 +71,49 @@ struct coremap *init_coremap()
     struct coremap *cmap;
 
     cmap = kmalloc(sizeof(struct coremap));
-    cmap->coremapSize = (endAddr - startAddr) / PAGE_SIZE;
+    if (cmap == NULL)
+    {
+        panic("init_coremap: Out of memory\n");
+    }
+
+    /*
+     * Cover all of physical memory, starting at 0, so that an entry
+     * can be found from a physical address with a single shift.
+     */
+    cmap->coremapSize = endAddr / PAGE_SIZE;
 
     spinlock_init(&cmap->coreLock);
     
     cmap->entries = kmalloc(sizeof(struct coremap_entry) * cmap->coremapSize);
-
-    for(unsigned long i = 0; i < cmap->coremapSize; ++i)
+    if (cmap->entries == NULL)
     {
-        cmap->entries[i].paddr = startAddr + (i * PAGE_SIZE);
-        cmap->entries[i].owner = 0;
-        cmap->entries[i].inUse = 0;
+        panic("init_coremap: Out of memory\n");
     }
 
+    /*
+     * Everything below the first free page (exception handlers,
+     * the kernel image, and whatever was stolen during boot,
+     * including the coremap itself) belongs to the kernel for good.
+     */
     paddr_t beginAddr = 0;
     
     ram_getsize(&beginAddr,&endAddr);
 
-    for (unsigned long i = 0; cmap->entries[i].paddr < beginAddr; ++i)
+    cmap->freeCount = 0;
+    for(unsigned long i = 0; i < cmap->coremapSize; ++i)
     {
-        cmap->entries[i].inUse = 1;
+        cmap->entries[i].cme_owner = NULL;
+        if (COREMAP_PADDR(i) < beginAddr)
+        {
+            cmap->entries[i].cme_flags = CME_INUSE | CME_FIXED;
+        }
+        else
+        {
+            cmap->entries[i].cme_flags = 0;
+            ++cmap->freeCount;
+        }
     }
+    cmap->searchHint = COREMAP_INDEX(beginAddr);
 
     return cmap;
                    
@@ -102,62 +127,89 @@ vm_bootstrap(void)
     coremapReady = 1;
 }
 
+/*
+ * Number of entries to step over to get past the (allocated) entry I.
+ * The first page of a run knows how long the run is; anything else
+ * that is in use (boot memory) is skipped one page at a time.
+ */
+static
+unsigned long
+coremap_skip(unsigned long i)
+{
+    struct coremap_entry *cme = &coremap->entries[i];
+
+    if ((cme->cme_flags & CME_HEAD) && CME_RUNLENGTH(cme) > 0)
+    {
+        return CME_RUNLENGTH(cme);
+    }
+    return 1;
+}
+
+/*
+ * Find and claim a run of npages free frames. Returns 0 if there
+ * isn't one.
+ */
 static
 paddr_t
-getppages(unsigned long npages)
+coremap_alloc(unsigned long npages)
 {
 	paddr_t addr = 0;
 
-        if (!coremapReady)
-        {
-            spinlock_acquire(&stealmem_lock);
-
-            addr = ram_stealmem(npages);
-	
-            spinlock_release(&stealmem_lock);
-            return addr;
-        }
+        KASSERT(npages > 0 && npages <= CME_RUNMASK);
 
         spinlock_acquire(&coremap->coreLock);
 
-        //kprintf("npages: %lu\n", npages);
+        if (npages > coremap->freeCount)
+        {
+            spinlock_release(&coremap->coreLock);
+            return 0;
+        }
 
-        unsigned int blockCount = 0;
+        unsigned long i = coremap->searchHint;
 
-        for(unsigned long i = 0; i<coremap->coremapSize; ++i)
+        while (i + npages <= coremap->coremapSize)
         {
-            if(!coremap->entries[i].inUse)
+            if (coremap->entries[i].cme_flags & CME_INUSE)
             {
-                for (unsigned long j = i; j<coremap->coremapSize; ++j)
+                i += coremap_skip(i);
+                continue;
+            }
+
+            /* See if there are npages free entries starting at i. */
+            unsigned long j;
+            for (j = i; j < i + npages; ++j)
+            {
+                if (coremap->entries[j].cme_flags & CME_INUSE)
                 {
-                    if(!coremap->entries[j].inUse)
-                    {
-                        ++blockCount;
-                    }
-                    
-                    if(blockCount == npages)
-                    {
-                        addr = coremap->entries[i].paddr;
-                        for (unsigned long k = i; k<=j; ++k)
-                        {
-                            coremap->entries[k].owner = addr;
-                            coremap->entries[k].inUse = 1;
-                            //kprintf("Using: %lu\n", k);
-                            //kprintf("k: %lu, paddr: %p, owner: %p \n",i,(void *) coremap->entries[k].paddr, (void *) coremap->entries[k].owner);
-                        }
-
-                        //kprintf("addr: %p\n", (void *)addr);
-                        spinlock_release(&coremap->coreLock);
-                        return addr;
-                    }
-
-                    if(coremap->entries[j].inUse)
-                    {
-                        break;
-                    }
+                    break;
                 }
-                blockCount = 0;
             }
+
+            if (j < i + npages)
+            {
+                /* Too short; carry on from the entry that stopped us. */
+                i = j;
+                continue;
+            }
+
+            coremap->entries[i].cme_flags = CME_INUSE | CME_HEAD |
+                (1 << CME_REFSHIFT) | npages;
+            coremap->entries[i].cme_owner = NULL;
+            for (j = i + 1; j < i + npages; ++j)
+            {
+                coremap->entries[j].cme_flags = CME_INUSE;
+                coremap->entries[j].cme_owner = NULL;
+            }
+
+            coremap->freeCount -= npages;
+            if (i == coremap->searchHint)
+            {
+                coremap->searchHint = i + npages;
+            }
+
+            addr = COREMAP_PADDR(i);
+            spinlock_release(&coremap->coreLock);
+            return addr;
         }
 
         //error return 0;
@@ -166,36 +218,100 @@ getppages(unsigned long npages)
         return 0;
 }
 
+static
+paddr_t
+getppages(unsigned long npages)
+{
+	paddr_t addr = 0;
+
+        if (!coremapReady)
+        {
+            spinlock_acquire(&stealmem_lock);
+
+            addr = ram_stealmem(npages);
+	
+            spinlock_release(&stealmem_lock);
+            return addr;
+        }
+
+        addr = coremap_alloc(npages);
+        if (addr == 0 && shrink_caches(npages) > 0)
+        {
+            /*
+             * Out of memory, but the kernel caches gave some back.
+             * The freed frames may not be contiguous, so this can
+             * still fail for multi-page requests.
+             */
+            addr = coremap_alloc(npages);
+        }
+
+        /*
+         * Have the page-out daemon top free memory back up before
+         * the next caller finds it empty.
+         */
+        if (coremap->freeCount < pageout_lowwater)
+        {
+            pageout_wakeup();
+        }
+
+        return addr;
+}
+
 static void releaseppages(paddr_t paddr)
 {
+    unsigned long i = COREMAP_INDEX(paddr);
+
+    /*
+     * Physical page 0 is never handed out, so 0 means "no page";
+     * as_destroy passes it for page table slots that never got one.
+     */
+    if (paddr == 0)
+    {
+        return;
+    }
+
+    /* Stolen before the coremap existed; it will be marked fixed. */
+    if (!coremapReady)
+    {
+        return;
+    }
+
+    KASSERT((paddr & PAGE_FRAME) == paddr);
+    KASSERT(i < coremap->coremapSize);
+
     spinlock_acquire(&coremap->coreLock);
-    //kprintf("free: %p\n", (void *)paddr);
-    for (unsigned long i = 0; i<coremap->coremapSize; ++i)
+
+    struct coremap_entry *cme = &coremap->entries[i];
+
+    if (cme->cme_flags & CME_FIXED)
     {
-        //kprintf("i: %lu, paddr: %p, owner: %p \n",i,(void *) coremap->entries[i].paddr, (void *) coremap->entries[i].owner);
-        if(coremap->entries[i].paddr == paddr)
-        {
-            if(coremap->entries[i].owner == paddr)
-            {
-                unsigned long j = i;
-                while (coremap->entries[j].owner == paddr)
-                {
-                    //kprintf("j: %lu, paddr: %p, owner: %p \n",j,(void *) coremap->entries[j].paddr, (void *) coremap->entries[j].owner);
-                    coremap->entries[j].owner = 0;
-                    coremap->entries[j].inUse = 0;
-                    //kprintf("freeing: %lu\n", j);
-                    ++j;
-                }
-                spinlock_release(&coremap->coreLock);
-                return;
-            }
-            else
-            {
-                //error
-                break;
-            }
-        }
+        /*
+         * Memory handed out by ram_stealmem before the coremap
+         * existed (e.g. kmalloc pages from early boot). It isn't
+         * tracked in runs, so it just stays allocated.
+         */
+        spinlock_release(&coremap->coreLock);
+        return;
     }
+
+    KASSERT((cme->cme_flags & (CME_INUSE | CME_HEAD)) ==
+            (CME_INUSE | CME_HEAD));
+
+    unsigned long npages = CME_RUNLENGTH(cme);
+    KASSERT(i + npages <= coremap->coremapSize);
+
+    for (unsigned long j = i; j < i + npages; ++j)
+    {
+        coremap->entries[j].cme_flags = 0;
+        coremap->entries[j].cme_owner = NULL;
+    }
+
+    coremap->freeCount += npages;
+    if (i < coremap->searchHint)
+    {
+        coremap->searchHint = i;
+    }
+
     spinlock_release(&coremap->coreLock);
 }
 
@@ -220,17 +336,359 @@ free_kpages(vaddr_t addr)
     releaseppages(addr);
 }
 
+/*
+ * Record/look up the owner of the kernel page (or run of pages)
+ * starting at addr. The owner is cleared when the page is freed.
+ */
+void
+kpage_setowner(vaddr_t addr, void *owner)
+{
+    unsigned long i = COREMAP_INDEX(KVADDR_TO_PADDR(addr));
+
+    KASSERT(coremapReady);
+    KASSERT(i < coremap->coremapSize);
+
+    spinlock_acquire(&coremap->coreLock);
+    KASSERT(coremap->entries[i].cme_flags & (CME_HEAD | CME_FIXED));
+    coremap->entries[i].cme_owner = owner;
+    spinlock_release(&coremap->coreLock);
+}
+
+void *
+kpage_getowner(vaddr_t addr)
+{
+    unsigned long i = COREMAP_INDEX(KVADDR_TO_PADDR(addr));
+    void *owner;
+
+    KASSERT(coremapReady);
+    KASSERT(i < coremap->coremapSize);
+
+    spinlock_acquire(&coremap->coreLock);
+    owner = coremap->entries[i].cme_owner;
+    spinlock_release(&coremap->coreLock);
+
+    return owner;
+}
+
+/*
+ * Number of free physical pages. This is only a snapshot; it may be
+ * out of date by the time the caller looks at it.
+ */
+unsigned
+vm_freepages(void)
+{
+    if (!coremapReady)
+    {
+        return 0;
+    }
+    return coremap->freeCount;
+}
+
+/*
+ * Number of physical pages the coremap manages, free or not.
+ */
+unsigned
+vm_totalpages(void)
+{
+    if (!coremapReady)
+    {
+        return 0;
+    }
+    return coremap->coremapSize;
+}
+
+/*
+ * Kernel virtual memory in kseg2.
+ *
+ * vmalloc maps single, not necessarily contiguous, frames at
+ * consecutive kseg2 addresses so that large buffers don't need
+ * physically contiguous memory. The mappings are kept in
+ * kseg2_ptable and loaded into the TLB on demand by vm_fault.
+ *
+ * Any access to kseg2 can take a TLB miss, so it must never be used
+ * for memory touched by the exception path itself (thread stacks in
+ * particular).
+ */
+
+/* 4M of kernel virtual space */
+#define KSEG2_NPAGES  1024
+
+/* Marks a kseg2 page that is allocated but not (yet) backed */
+#define KSEG2_PENDING ((paddr_t)1)
+
+struct kseg2_pte
+{
+    paddr_t kp_paddr;       /* frame, 0 if free, or KSEG2_PENDING */
+    unsigned kp_npages;     /* length of the allocation (first page only) */
+    bool kp_unmapped;       /* being freed; don't load into the TLB */
+};
+
+static struct kseg2_pte kseg2_ptable[KSEG2_NPAGES];
+static unsigned kseg2_cursor;
+static struct spinlock kseg2_lock = SPINLOCK_INITIALIZER;
+
+#define KSEG2_VADDR(index)  (MIPS_KSEG2 + (vaddr_t)(index) * PAGE_SIZE)
+#define KSEG2_INDEX(vaddr)  (((vaddr) - MIPS_KSEG2) / PAGE_SIZE)
+
+/*
+ * Reserve npages consecutive kseg2 pages. Searching starts where the
+ * last allocation ended, to spread use over the table. Returns
+ * KSEG2_NPAGES on failure.
+ */
+static
+unsigned
+kseg2_reserve(unsigned npages)
+{
+    unsigned start, i, j, tries;
+
+    spinlock_acquire(&kseg2_lock);
+
+    start = kseg2_cursor;
+    for (tries = 0; tries < KSEG2_NPAGES; tries++)
+    {
+        i = (start + tries) % KSEG2_NPAGES;
+        if (i + npages > KSEG2_NPAGES)
+        {
+            continue;
+        }
+        for (j = i; j < i + npages; ++j)
+        {
+            if (kseg2_ptable[j].kp_paddr != 0)
+            {
+                break;
+            }
+        }
+        if (j < i + npages)
+        {
+            continue;
+        }
+
+        for (j = i; j < i + npages; ++j)
+        {
+            kseg2_ptable[j].kp_paddr = KSEG2_PENDING;
+            kseg2_ptable[j].kp_npages = 0;
+        }
+        kseg2_ptable[i].kp_npages = npages;
+        kseg2_cursor = (i + npages) % KSEG2_NPAGES;
+
+        spinlock_release(&kseg2_lock);
+        return i;
+    }
+
+    spinlock_release(&kseg2_lock);
+    return KSEG2_NPAGES;
+}
+
+/*
+ * Remove any TLB entry for a kernel page here and ask every other CPU
+ * to do the same. Call with preemption disabled, so that the CPU the
+ * broadcast skips is the one flushed locally.
+ */
+static
+void
+kseg2_shootdown(vaddr_t vaddr)
+{
+    struct tlbshootdown ts;
+
+    ts.ts_addrspace = NULL;
+    ts.ts_vaddr = vaddr;
+
+    vm_tlbshootdown(&ts);
+    ipi_tlbshootdown_broadcast(&ts);
+}
+
+/*
+ * Unmap and free the npages kseg2 pages starting at index. The frames
+ * and the addresses are only given back once every CPU has dropped
+ * its TLB entries for them; until then the pages stay reserved, and
+ * marked unmapped so vm_fault won't load them again.
+ */
+static
+void
+kseg2_release(unsigned index, unsigned npages)
+{
+    paddr_t paddr;
+
+    spinlock_acquire(&kseg2_lock);
+    for (unsigned i = index; i < index + npages; ++i)
+    {
+        kseg2_ptable[i].kp_unmapped = true;
+    }
+    spinlock_release(&kseg2_lock);
+
+    thread_preempt_disable();
+    for (unsigned i = index; i < index + npages; ++i)
+    {
+        if (kseg2_ptable[i].kp_paddr != KSEG2_PENDING)
+        {
+            kseg2_shootdown(KSEG2_VADDR(i));
+        }
+    }
+    ipi_tlbshootdown_wait();
+    thread_preempt_enable();
+
+    for (unsigned i = index; i < index + npages; ++i)
+    {
+        spinlock_acquire(&kseg2_lock);
+        paddr = kseg2_ptable[i].kp_paddr;
+        kseg2_ptable[i].kp_paddr = 0;
+        kseg2_ptable[i].kp_npages = 0;
+        kseg2_ptable[i].kp_unmapped = false;
+        spinlock_release(&kseg2_lock);
+
+        if (paddr != KSEG2_PENDING)
+        {
+            releaseppages(paddr);
+        }
+    }
+}
+
+/*
+ * Allocate sz bytes of virtually contiguous kernel memory. Requests
+ * small enough for the subpage allocator are passed to kmalloc.
+ */
+void *
+vmalloc(size_t sz)
+{
+    unsigned npages, index;
+    paddr_t paddr;
+
+    if (sz <= PAGE_SIZE / 2)
+    {
+        return kmalloc(sz);
+    }
+
+    npages = DIVROUNDUP(sz, PAGE_SIZE);
+    if (npages > KSEG2_NPAGES)
+    {
+        return NULL;
+    }
+
+    index = kseg2_reserve(npages);
+    if (index == KSEG2_NPAGES)
+    {
+        return NULL;
+    }
+
+    for (unsigned i = index; i < index + npages; ++i)
+    {
+        paddr = getppages(1);
+        if (paddr == 0)
+        {
+            kseg2_release(index, npages);
+            return NULL;
+        }
+
+        spinlock_acquire(&kseg2_lock);
+        kseg2_ptable[i].kp_paddr = paddr;
+        spinlock_release(&kseg2_lock);
+    }
+
+    return (void *)KSEG2_VADDR(index);
+}
+
+/*
+ * Free memory from vmalloc.
+ */
+void
+vfree(void *ptr)
+{
+    vaddr_t addr = (vaddr_t)ptr;
+    unsigned index, npages;
+
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    if (addr < MIPS_KSEG2)
+    {
+        kfree(ptr);
+        return;
+    }
+
+    KASSERT((addr & PAGE_FRAME) == addr);
+    index = KSEG2_INDEX(addr);
+    KASSERT(index < KSEG2_NPAGES);
+
+    spinlock_acquire(&kseg2_lock);
+    npages = kseg2_ptable[index].kp_npages;
+    spinlock_release(&kseg2_lock);
+
+    KASSERT(npages > 0);
+    kseg2_release(index, npages);
+}
+
+/*
+ * Load the TLB entry for a kseg2 address.
+ */
+static
+int
+kseg2_fault(vaddr_t faultaddress)
+{
+    unsigned index = KSEG2_INDEX(faultaddress);
+    paddr_t paddr;
+    uint32_t ehi, elo;
+    int i;
+
+    if (index >= KSEG2_NPAGES)
+    {
+        return EFAULT;
+    }
+
+    /*
+     * Hold the table lock until the entry is in the TLB, so that
+     * kseg2_release either sees us done before it shoots the page
+     * down or we see it marked unmapped.
+     */
+    spinlock_acquire(&kseg2_lock);
+    paddr = kseg2_ptable[index].kp_paddr;
+    if (paddr == 0 || paddr == KSEG2_PENDING ||
+        kseg2_ptable[index].kp_unmapped)
+    {
+        spinlock_release(&kseg2_lock);
+        return EFAULT;
+    }
+
+    for (i=0; i<NUM_TLB; i++)
+    {
+        tlb_read(&ehi, &elo, i);
+        if (!(elo & TLBLO_VALID))
+        {
+            tlb_write(faultaddress, paddr | TLBLO_DIRTY | TLBLO_VALID, i);
+            spinlock_release(&kseg2_lock);
+            return 0;
+        }
+    }
+    tlb_random(faultaddress, paddr | TLBLO_DIRTY | TLBLO_VALID);
+
+    spinlock_release(&kseg2_lock);
+    return 0;
+}
+
 void
 vm_tlbshootdown_all(void)
 {
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	int i, spl;
+
+	spl = splhigh();
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	splx(spl);
 }
 
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	int i, spl;
+
+	spl = splhigh();
+	i = tlb_probe(ts->ts_vaddr & PAGE_FRAME, 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	splx(spl);
 }
 
 int
@@ -248,6 +706,13 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
 
+	if (faultaddress >= MIPS_KSEG2) {
+		if (faulttype == VM_FAULT_READONLY) {
+			return EFAULT;
+		}
+		return kseg2_fault(faultaddress);
+	}
+
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
 		//TODO:kill current process
@@ -419,6 +884,17 @@ vm_fault(int faulttype, vaddr_t faultaddress)
         */
 }
 
+/*
+ * Freeing every page of a big address space takes a while, and
+ * nobody exiting or exec'ing needs to wait for it.
+ */
+static
+void
+as_destroy_work(void *data)
+{
+    as_destroy(data);
+}
+
 struct addrspace *
 as_create(void)
 {
@@ -446,6 +922,8 @@ as_create(void)
         as->as_ptable2 = NULL;
         as->as_ptableStack = NULL;
 
+        work_init(&as->as_destroywork, as_destroy_work, as);
+
 	return as;
 }
 
@@ -453,32 +931,48 @@ void
 as_destroy(struct addrspace *as)
 {
     
-    for(size_t i = 0; i < DUMBVM_STACKPAGES; ++i)
+    if (as->as_ptableStack != NULL)
     {
-        releaseppages(as->as_ptableStack[i].pframebase);
+        for(size_t i = 0; i < DUMBVM_STACKPAGES; ++i)
+        {
+            releaseppages(as->as_ptableStack[i].pframebase);
+        }
+        vfree(as->as_ptableStack);
     }
-    free_kpages((vaddr_t) as->as_ptableStack);
 
-    for(size_t i = 0; i < as->as_npages2; ++i)
+    if (as->as_ptable2 != NULL)
     {
-        releaseppages(as->as_ptable2[i].pframebase);
+        for(size_t i = 0; i < as->as_npages2; ++i)
+        {
+            releaseppages(as->as_ptable2[i].pframebase);
+        }
+        vfree(as->as_ptable2);
     }
-    free_kpages((vaddr_t) as->as_ptable2);
 
-    for(size_t i = 0; i < as->as_npages1; ++i)
+    if (as->as_ptable1 != NULL)
     {
-        releaseppages(as->as_ptable1[i].pframebase);
+        for(size_t i = 0; i < as->as_npages1; ++i)
+        {
+            releaseppages(as->as_ptable1[i].pframebase);
+        }
+        vfree(as->as_ptable1);
     }
-    free_kpages((vaddr_t) as->as_ptable1);
     
 
     //releaseppages(as->as_stackpbase);
     //releaseppages(as->as_pbase2);
     //releaseppages(as->as_pbase1);
     
+    work_cleanup(&as->as_destroywork);
     kfree(as);
 }
 
+void
+as_destroy_later(struct addrspace *as)
+{
+    work_enqueue(&as->as_destroywork);
+}
+
 void
 as_activate(void)
 {
@@ -558,7 +1052,7 @@ as_zero_region(paddr_t paddr, unsigned npages)
 int
 as_prepare_load(struct addrspace *as)
 {        
-        as->as_ptable1 = kmalloc(sizeof(struct pageEntiry) * as->as_npages1);
+        as->as_ptable1 = vmalloc(sizeof(struct pageEntiry) * as->as_npages1);
         if(as->as_ptable1 == NULL)
         {
             return ENOMEM;
@@ -578,7 +1072,7 @@ as_prepare_load(struct addrspace *as)
 
 
 
-        as->as_ptable2 = kmalloc(sizeof(struct pageEntiry) * as->as_npages2);
+        as->as_ptable2 = vmalloc(sizeof(struct pageEntiry) * as->as_npages2);
         if(as->as_ptable2 == NULL)
         {
             return ENOMEM;
@@ -598,7 +1092,7 @@ as_prepare_load(struct addrspace *as)
 
 
 
-        as->as_ptableStack = kmalloc(sizeof(struct pageEntiry) * DUMBVM_STACKPAGES);
+        as->as_ptableStack = vmalloc(sizeof(struct pageEntiry) * DUMBVM_STACKPAGES);
         if(as->as_ptableStack == NULL)
         {
             return ENOMEM;
@@ -732,6 +1226,7 @@ as_copy(struct addrspace *old, struct addrspace **ret)
             memmove((void *)PADDR_TO_KVADDR(new->as_ptable1[i].pframebase),
                     (const void *)PADDR_TO_KVADDR(old->as_ptable1[i].pframebase),
                     PAGE_SIZE);
+            thread_preempt_point();
         }
 
         for(size_t i = 0; i < old->as_npages2; ++i)
@@ -739,6 +1234,7 @@ as_copy(struct addrspace *old, struct addrspace **ret)
             memmove((void *)PADDR_TO_KVADDR(new->as_ptable2[i].pframebase),
                     (const void *)PADDR_TO_KVADDR(old->as_ptable2[i].pframebase),
                     PAGE_SIZE);
+            thread_preempt_point();
         }
 
         for(size_t i = 0; i < DUMBVM_STACKPAGES; ++i)
@@ -746,6 +1242,7 @@ as_copy(struct addrspace *old, struct addrspace **ret)
             memmove((void *)PADDR_TO_KVADDR(new->as_ptableStack[i].pframebase),
                     (const void *)PADDR_TO_KVADDR(old->as_ptableStack[i].pframebase),
                     PAGE_SIZE);
+            thread_preempt_point();
         }
         
 	
@@ -50,6 +50,16 @@
  */
 #define CPU_FREQUENCY 25000000 /* 25 MHz */
 
+/* Cycles per hardclock. */
+#define TIMER_PERIOD (CPU_FREQUENCY / HZ)
+
+/*
+ * When reprogramming the timer mid-tick, a compare value this close
+ * to the current count might be passed before it is written, which
+ * would delay the interrupt until the counter wraps around.
+ */
+#define TIMER_SLOP 1000
+
 /*
  * Access to the on-chip timer.
  *
@@ -73,6 +83,24 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Read the cycle counter. ($9 == c0_count.)
+ */
+static
+uint32_t
+mips_timer_get(void)
+{
+	uint32_t count;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		: "=r" (count));
+	return count;
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -113,7 +141,7 @@ mainbus_bootstrap(void)
 	/*
 	 * Configure the MIPS on-chip timer to interrupt HZ times a second.
 	 */
-	mips_timer_set(CPU_FREQUENCY / HZ);
+	mips_timer_set(TIMER_PERIOD);
 }
 
 /*
@@ -242,6 +270,38 @@ mainbus_send_ipi(struct cpu *target)
 	lamebus_assert_ipi(lamebus, target);
 }
 
+/*
+ * Tickless idle. The counter restarts from zero at each timer
+ * interrupt, so it measures the time since the last hardclock and
+ * a compare value that is a multiple of the period keeps the ticks
+ * that follow on the same boundaries.
+ *
+ * Call these with interrupts off.
+ */
+void
+mainbus_timer_defer(unsigned hardclocks)
+{
+	KASSERT(hardclocks > 0);
+	KASSERT(hardclocks <= 0xffffffff / TIMER_PERIOD);
+	mips_timer_set(hardclocks * TIMER_PERIOD);
+}
+
+unsigned
+mainbus_timer_resume(void)
+{
+	uint32_t count;
+	unsigned elapsed;
+
+	count = mips_timer_get();
+	elapsed = count / TIMER_PERIOD;
+	if ((elapsed + 1) * TIMER_PERIOD - count < TIMER_SLOP) {
+		/* Too close to the next boundary; take the one after. */
+		elapsed++;
+	}
+	mips_timer_set((elapsed + 1) * TIMER_PERIOD);
+	return elapsed;
+}
+
 /*
  * Interrupt dispatcher.
  */
@@ -269,7 +329,7 @@ mainbus_interrupt(struct trapframe *tf)
 	}
 	else if (cause & MIPS_TIMER_BIT) {
 		/* Reset the timer (this clears the interrupt) */
-		mips_timer_set(CPU_FREQUENCY / HZ);
+		mips_timer_set(TIMER_PERIOD);
 		/* and call hardclock */
 		hardclock();
 	}
@@ -68,3 +68,16 @@ gettime(time_t *secs, uint32_t *nsecs)
 	KASSERT(the_clock!=NULL);
 	the_clock->rtc_gettime(the_clock->rtc_devdata, secs, nsecs);
 }
+
+uint32_t
+clock_usec(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	if (the_clock == NULL) {
+		return 0;
+	}
+	the_clock->rtc_gettime(the_clock->rtc_devdata, &secs, &nsecs);
+	return (uint32_t)secs * 1000000 + nsecs / 1000;
+}
@@ -36,6 +36,7 @@
 #include <lib.h>
 #include <uio.h>
 #include <synch.h>
+#include <thread.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -270,6 +271,9 @@ lhd_io(struct device *d, struct uio *uio)
 		if (result) {
 			return result;
 		}
+
+		/* Let anyone we woke have the cpu if they need it. */
+		thread_preempt_point();
 	}
 
 	return 0;
@@ -40,6 +40,7 @@
 #include <bitmap.h>
 #include <uio.h>
 #include <vfs.h>
+#include <thread.h>
 #include <device.h>
 #include <sfs.h>
 
@@ -153,6 +154,7 @@ sfs_sync(struct fs *fs)
 	for (i=0; i<num; i++) {
 		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
 		VOP_FSYNC(v);
+		thread_preempt_point();
 	}
 
 	/* If the free block map needs to be written, write it. */
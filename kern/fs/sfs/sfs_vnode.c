@@ -43,6 +43,7 @@
 #include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <pagecache.h>
 #include <sfs.h>
 
 /* At bottom of file */
@@ -441,37 +442,23 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 }
 
 /*
- * Do I/O of a whole region of data, whether or not it's block-aligned.
+ * Do LEN bytes of I/O straight between the disk and the uio, whether
+ * or not it's block-aligned. This bypasses the page cache; it is
+ * only used when there's no memory for a cache page.
  */
 static
 int
-sfs_io(struct sfs_vnode *sv, struct uio *uio)
+sfs_directio(struct sfs_vnode *sv, struct uio *uio, uint32_t len)
 {
 	uint32_t blkoff;
 	uint32_t nblocks, i;
 	int result = 0;
-	uint32_t extraresid = 0;
-
-	/*
-	 * If reading, check for EOF. If we can read a partial area,
-	 * remember how much extra there was in EXTRARESID so we can
-	 * add it back to uio_resid at the end.
-	 */
-	if (uio->uio_rw == UIO_READ) {
-		off_t size = sv->sv_i.sfi_size;
-		off_t endpos = uio->uio_offset + uio->uio_resid;
+	size_t extraresid;
 
-		if (uio->uio_offset >= size) {
-			/* At or past EOF - just return */
-			return 0;
-		}
-
-		if (endpos > size) {
-			extraresid = endpos - size;
-			KASSERT(uio->uio_resid > extraresid);
-			uio->uio_resid -= extraresid;
-		}
-	}
+	/* Hide everything past LEN from the code below. */
+	KASSERT(len <= uio->uio_resid);
+	extraresid = uio->uio_resid - len;
+	uio->uio_resid = len;
 
 	/*
 	 * First, do any leading partial block.
@@ -526,6 +513,158 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	}
 
  out:
+	uio->uio_resid += extraresid;
+	return result;
+}
+
+/* Number of file blocks in one page cache page */
+#define SFS_BLOCKSPERPAGE  (PAGE_SIZE / SFS_BLOCKSIZE)
+
+/*
+ * Read the file data for a page cache page from disk. Holes, and
+ * anything past the largest possible file, read as zeros.
+ */
+static
+int
+sfs_fillpage(struct sfs_vnode *sv, struct pcpage *pp)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t fileblock, diskblock;
+	char *data;
+	unsigned i;
+	int result;
+
+	for (i=0; i<SFS_BLOCKSPERPAGE; i++) {
+		data = (char *)pp->pp_kva + i*SFS_BLOCKSIZE;
+		fileblock = pp->pp_offset / SFS_BLOCKSIZE + i;
+
+		result = sfs_bmap(sv, fileblock, 0, &diskblock);
+		if (result == EFBIG) {
+			diskblock = 0;
+		}
+		else if (result) {
+			return result;
+		}
+
+		if (diskblock == 0) {
+			bzero(data, SFS_BLOCKSIZE);
+		}
+		else {
+			result = sfs_rblock(sfs, data, diskblock);
+			if (result) {
+				return result;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write the blocks of a page cache page that overlap the byte range
+ * [start, end) of the page back to disk, allocating them if needed.
+ */
+static
+int
+sfs_writepage(struct sfs_vnode *sv, struct pcpage *pp,
+	      uint32_t start, uint32_t end)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t fileblock, diskblock;
+	unsigned i;
+	int result;
+
+	KASSERT(start < end && end <= PAGE_SIZE);
+
+	for (i = start / SFS_BLOCKSIZE; i*SFS_BLOCKSIZE < end; i++) {
+		fileblock = pp->pp_offset / SFS_BLOCKSIZE + i;
+
+		result = sfs_bmap(sv, fileblock, 1, &diskblock);
+		if (result) {
+			return result;
+		}
+		result = sfs_wblock(sfs, (char *)pp->pp_kva + i*SFS_BLOCKSIZE,
+				    diskblock);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Do I/O of a whole region of data, whether or not it's block-aligned.
+ *
+ * The data goes through the page cache a page at a time. Reads fill
+ * pages that aren't cached yet; writes update the cached page and
+ * write the blocks they touched straight through to disk, so cached
+ * pages are never dirty.
+ */
+static
+int
+sfs_io(struct sfs_vnode *sv, struct uio *uio)
+{
+	struct pcpage *pp;
+	off_t pageoff;
+	uint32_t skip, len;
+	int result = 0;
+	uint32_t extraresid = 0;
+
+	/*
+	 * If reading, check for EOF. If we can read a partial area,
+	 * remember how much extra there was in EXTRARESID so we can
+	 * add it back to uio_resid at the end.
+	 */
+	if (uio->uio_rw == UIO_READ) {
+		off_t size = sv->sv_i.sfi_size;
+		off_t endpos = uio->uio_offset + uio->uio_resid;
+
+		if (uio->uio_offset >= size) {
+			/* At or past EOF - just return */
+			return 0;
+		}
+
+		if (endpos > size) {
+			extraresid = endpos - size;
+			KASSERT(uio->uio_resid > extraresid);
+			uio->uio_resid -= extraresid;
+		}
+	}
+
+	while (uio->uio_resid > 0) {
+		skip = uio->uio_offset % PAGE_SIZE;
+		pageoff = uio->uio_offset - skip;
+		len = PAGE_SIZE - skip;
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+
+		pp = pagecache_get(&sv->sv_v, pageoff);
+		if (pp == NULL) {
+			result = sfs_directio(sv, uio, len);
+			if (result) {
+				break;
+			}
+			continue;
+		}
+
+		/* A write of the whole page doesn't need the old contents. */
+		if (!pp->pp_valid &&
+		    !(uio->uio_rw == UIO_WRITE && len == PAGE_SIZE)) {
+			result = sfs_fillpage(sv, pp);
+		}
+		if (!result) {
+			result = uiomove((char *)pp->pp_kva + skip, len, uio);
+		}
+		if (!result && uio->uio_rw == UIO_WRITE) {
+			result = sfs_writepage(sv, pp, skip, skip + len);
+		}
+
+		/* On failure the page's contents are suspect; drop it. */
+		pagecache_release(pp, result == 0);
+		if (result) {
+			break;
+		}
+	}
 
 	/* If writing, adjust file length */
 	if (uio->uio_rw == UIO_WRITE && 
@@ -948,6 +1087,9 @@ sfs_reclaim(struct vnode *v)
 	}
 	vnodearray_remove(sfs->sfs_vnodes, ix);
 
+	/* The page cache must not outlive the vnode its pages point to. */
+	pagecache_invalidate(&sv->sv_v, 0);
+
 	VOP_CLEANUP(&sv->sv_v);
 
 	vfs_biglock_release();
@@ -1151,6 +1293,12 @@ sfs_truncate(struct vnode *v, off_t len)
 
 	vfs_biglock_acquire();
 
+	/*
+	 * Drop cached pages past the new end of file, and the one it
+	 * falls in, before their blocks can be freed and reused.
+	 */
+	pagecache_invalidate(v, len);
+
 	/*
 	 * Go through the direct blocks. Discard any that are
 	 * past the limit we're truncating to.
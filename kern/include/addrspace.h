@@ -36,6 +36,7 @@
 
 
 #include <vm.h>
+#include <workqueue.h>
 
 struct vnode;
 
@@ -73,7 +74,8 @@ struct addrspace {
     //paddr_t as_stackpbase;
 
     struct pageEntiry *as_ptableStack;
-    
+
+    struct work as_destroywork;   /* for as_destroy_later */
 };
 
 /*
@@ -98,6 +100,9 @@ struct addrspace {
  *    as_destroy - dispose of an address space. You may need to change
  *                the way this works if implementing user-level threads.
  *
+ *    as_destroy_later - same, but leave the work to this cpu's kernel
+ *                worker thread, so exit and exec don't wait for it.
+ *
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
@@ -117,6 +122,7 @@ int               as_copy(struct addrspace *src, struct addrspace **ret);
 void              as_activate(void);
 void              as_deactivate(void);
 void              as_destroy(struct addrspace *);
+void              as_destroy_later(struct addrspace *);
 
 int               as_define_region(struct addrspace *as, 
                                    vaddr_t vaddr, size_t sz,
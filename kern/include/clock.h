@@ -32,16 +32,25 @@
 
 #include "opt-synchprobs.h"
 
+struct timespec;	/* from <kern/time.h> */
+
 /*
  * Time-related definitions.
  *
  * hardclock() is called on every CPU HZ times a second, possibly only
  * when the CPU is not idle, for scheduling.
  *
+ * hardclock_idle_enter() and hardclock_idle_exit() bracket the idle
+ * loop's wait for an interrupt and stop the per-cpu timer from
+ * ticking while there is nothing to do.
+ *
  * timerclock() is called on one CPU once a second to allow simple
  * timed operations. (This is a fairly simpleminded interface.)
  *
  * gettime() may be used to fetch the current time of day.
+ * clock_usec() returns the time of day in microseconds, modulo 2^32,
+ * for measuring short intervals; it returns 0 until a clock device
+ * has been attached, so it's safe to call during boot.
  * getinterval() computes the time from time1 to time2.
  *
  * XXX we have struct timespec now, let's use it.
@@ -61,7 +70,11 @@ void hardclock_bootstrap(void);
 void hardclock(void);
 void timerclock(void);
 
+void hardclock_idle_enter(void);
+void hardclock_idle_exit(void);
+
 void gettime(time_t *seconds, uint32_t *nanoseconds);
+uint32_t clock_usec(void);
 
 void getinterval(time_t secs1, uint32_t nsecs,
                  time_t secs2, uint32_t nsecs2,
@@ -73,5 +86,13 @@ void getinterval(time_t secs1, uint32_t nsecs,
  */
 void clocksleep(int seconds);
 
+/*
+ * thread_sleep_until() suspends execution until the time of day
+ * reaches WHEN, to within a hardclock. hardclocks_until() says how
+ * many hardclocks away WHEN is.
+ */
+void thread_sleep_until(const struct timespec *when);
+unsigned hardclocks_until(const struct timespec *when);
+
 
 #endif /* _CLOCK_H_ */
@@ -2,22 +2,52 @@
 #define _COREMAP_H_
 
 #include <spinlock.h>
+#include <vm.h>
 
+/*
+ * Physical page frame descriptor.
+ *
+ * There is one of these for every page of physical memory, starting
+ * at physical address 0. The physical address of a page is not
+ * stored; it is the index of its entry times PAGE_SIZE.
+ *
+ * cme_flags packs the page state, a reference count and, in the first
+ * page of an allocated run, the number of pages in the run. This
+ * keeps the whole entry to two words, so the allocator's scans touch
+ * as few cache lines as possible.
+ *
+ * cme_owner is a back-pointer for whoever owns the page; it is NULL
+ * unless the owner sets it.
+ */
 struct coremap_entry
 {
-    paddr_t paddr;
-    paddr_t owner;
-    volatile bool inUse;
+    uint32_t cme_flags;
+    void *cme_owner;
 };
 
+#define CME_INUSE      0x80000000  /* page is allocated */
+#define CME_FIXED      0x40000000  /* kernel image or boot memory; never freed */
+#define CME_HEAD       0x20000000  /* first page of an allocated run */
+#define CME_REFMASK    0x0ff00000  /* reference count */
+#define CME_REFSHIFT   20
+#define CME_RUNMASK    0x000fffff  /* run length (CME_HEAD pages only) */
+
+#define CME_REFCOUNT(cme)  (((cme)->cme_flags & CME_REFMASK) >> CME_REFSHIFT)
+#define CME_RUNLENGTH(cme) ((cme)->cme_flags & CME_RUNMASK)
+
+/* Conversions between physical addresses and coremap indexes */
+#define COREMAP_INDEX(paddr)  ((paddr) / PAGE_SIZE)
+#define COREMAP_PADDR(index)  ((paddr_t)(index) * PAGE_SIZE)
+
 struct coremap
 {
     struct spinlock coreLock;
     struct coremap_entry *entries;
-    unsigned int coremapSize;
+    unsigned int coremapSize;   /* number of entries (pages of RAM) */
+    unsigned int freeCount;     /* number of entries not in use */
+    unsigned int searchHint;    /* every entry below this is in use */
 };
 
 struct coremap *init_coremap(void);
-static void releaseppages(paddr_t paddr);
 
 #endif /* _COREMAP_H_ */
@@ -35,6 +35,23 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+struct timerwheel;	/* from <timer.h> */
+struct workpool;	/* from <workqueue.h> */
+
+/* Number of time-sharing priority levels. Level 0 is the highest. */
+#define SCHED_NLEVELS  4
+
+/*
+ * Run queues, in the order they are served: real-time threads first,
+ * then one queue per time-sharing level.
+ */
+#define SCHED_RTQUEUE        0
+#define SCHED_TSQUEUE(level) ((level) + 1)
+#define SCHED_NQUEUES        (SCHED_NLEVELS + 1)
+
+/* Buckets in the scheduler latency histograms. */
+#define SCHED_HISTSIZE  12
+
 
 /*
  * Per-cpu structure
@@ -58,15 +75,63 @@ struct cpu {
 	 * Accessed only by this cpu.
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
+	struct thread *c_idlethread;	/* Runs when nothing else can */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_steals;		/* Threads taken from other cpus */
+	unsigned c_migrations;		/* Threads pushed to other cpus */
+	unsigned c_forkedout;		/* Threads forked onto other cpus */
+	unsigned c_tickless;		/* Hardclocks the timer is skipping */
+	unsigned c_idleticks;		/* Hardclocks skipped while idle */
+	unsigned c_quietticks;		/* Quantum ends with no one waiting */
+	unsigned c_rtticks;		/* Real-time ticks since schedule() */
+	bool c_rtthrottled;		/* Real-time threads used up theirs */
+	unsigned c_rtthrottles;		/* Times that has happened */
+
+	/*
+	 * Context switch statistics, kept by thread_switch. Times are
+	 * in microseconds. The histograms are described at
+	 * thread_printlatency.
+	 */
+	unsigned c_switches;		/* Switches to another thread */
+	unsigned c_voluntary;		/* ...because it blocked or exited */
+	unsigned c_involuntary;		/* ...because it yielded the cpu */
+	unsigned c_idles;		/* Switches to the idle thread */
+	unsigned c_preemptions;		/* ...forced at the end of an interrupt */
+	uint32_t c_maxwait;		/* Longest time runnable until run */
+	uint64_t c_idletime;		/* Time spent in the idle thread */
+	unsigned c_waithist[SCHED_HISTSIZE];	/* Runnable until run */
+	unsigned c_slicehist[SCHED_HISTSIZE];	/* Run until switched out */
+
+	/*
+	 * Timers added on this cpu. Other cpus lock it to cancel them.
+	 */
+	struct timerwheel *c_timers;
+
+	/*
+	 * Deferred work queued on this cpu, and the worker that runs it.
+	 * Has its own locking.
+	 */
+	struct workpool *c_workpool;
+
+	/*
+	 * Exited threads kept, stack and all, for thread_fork to reuse.
+	 * Protected by c_shells_lock, since the thread shrinker may
+	 * empty the list from any cpu.
+	 */
+	struct threadlist c_shells;
+	struct spinlock c_shells_lock;
 
 	/*
 	 * Accessed by other cpus.
-	 * Protected by the runqueue lock.
+	 * Protected by the runqueue lock. Other cpus also read
+	 * c_runcount without the lock, as a hint for load balancing.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	bool c_needresched;		/* Current thread should yield */
+	struct threadlist c_runqueue[SCHED_NQUEUES]; /* See SCHED_RTQUEUE */
+	volatile unsigned c_runcount;	/* Threads on all the run queues */
+	unsigned c_vclock;		/* Fair-share clock; see thread.c */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -86,7 +151,22 @@ struct cpu {
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	unsigned c_shootdowns_posted;	/* Shootdowns ever sent here */
+	volatile unsigned c_shootdowns_done; /* ...and handled (a count) */
 	struct spinlock c_ipi_lock;
+
+	/*
+	 * Spinlock queue nodes; see spinlock.c. Taken and given back
+	 * only by this cpu, with interrupts off. Other cpus write the
+	 * links and flags while lined up behind us.
+	 */
+	struct spinnode c_spinnodes[SPINLOCK_NODES];
+
+	/*
+	 * Per-cpu kmalloc block caches. Created by kmalloc the first
+	 * time this cpu needs them; protected by their own lock.
+	 */
+	struct kmalloc_cpucache *c_kmcache;
 };
 
 #define TLBSHOOTDOWN_ALL  (-1)
@@ -152,6 +232,10 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_broadcast sends it to all CPUs except the current one.
+ * ipi_tlbshootdown_wait waits until every other CPU has handled all the
+ * shootdowns sent to it so far. It must be called with interrupts on,
+ * since the others may be waiting on us.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -166,6 +250,8 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_wait(void);
 
 void interprocessor_interrupt(void);
 
@@ -91,8 +91,8 @@
 //#define SYS_getrlimit  36
 //#define SYS_setrlimit  37
 //                              (process priority control)
-//#define SYS_getpriority 38
-//#define SYS_setpriority 39
+#define SYS_getpriority  38
+#define SYS_setpriority  39
 //                              (process groups, sessions, and job control)
 //#define SYS_getpgid    40
 //#define SYS_setpgid    41
@@ -197,6 +197,10 @@
 #define SYS_reboot       119
 //#define SYS___sysctl   120
 
+//                              -- Scheduling --
+#define SYS_setaffinity  121
+#define SYS_getaffinity  122
+
 /*CALLEND*/
 
 
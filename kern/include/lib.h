@@ -126,6 +126,16 @@ uint32_t random(void);
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
+void kheap_bootstrap(void);
+
+/*
+ * Heap profiling: while on, kmalloc records each live block's size and
+ * call site. kheap_profile_start turns it on (or resets it) and can
+ * fail with ENOMEM; kheap_profile_dump prints the busiest call sites.
+ */
+int kheap_profile_start(void);
+void kheap_profile_stop(void);
+void kheap_profile_dump(void);
 
 /*
  * C string functions. 
@@ -55,6 +55,16 @@ size_t mainbus_ramsize(void);
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
+/*
+ * Per-cpu timer control for tickless idle. (Low-level; see
+ * hardclock_idle_enter.) mainbus_timer_defer sets the current cpu's
+ * timer to skip the next HARDCLOCKS-1 ticks. mainbus_timer_resume
+ * goes back to interrupting every tick and returns the number of
+ * ticks that went by without an interrupt.
+ */
+void mainbus_timer_defer(unsigned hardclocks);
+unsigned mainbus_timer_resume(void);
+
 /*
  * The various ways to shut down the system. (These are very low-level
  * and should generally not be called directly - md_poweroff, for
@@ -0,0 +1,41 @@
+#ifndef _OBJCACHE_H_
+#define _OBJCACHE_H_
+
+/*
+ * Typed object caches.
+ *
+ * An object cache hands out fixed-size objects of one type, packed
+ * back to back in page-sized slabs. Objects are carved at exactly the
+ * cache's object size (rounded up for alignment) instead of kmalloc's
+ * power-of-two sizes.
+ *
+ * If the cache has a constructor, it runs on every object when a slab
+ * is created, not on every allocation; objects are expected to be put
+ * back into their constructed state before objcache_free. The
+ * destructor runs when the slab is given back to the VM system. This
+ * lets embedded locks, wait channels, arrays and so on survive across
+ * uses instead of being created and destroyed each time.
+ *
+ * The constructor returns 0 or an error code; if it fails the
+ * allocation that triggered it returns NULL. The destructor may be
+ * called from the page allocator (empty slabs are released through
+ * a shrinker) so it must not sleep or allocate memory.
+ */
+
+struct objcache;
+
+/* Initialization; call before creating any caches. */
+void objcache_bootstrap(void);
+
+struct objcache *objcache_create(const char *name, size_t size,
+				 int (*ctor)(void *obj),
+				 void (*dtor)(void *obj));
+void objcache_destroy(struct objcache *oc);
+
+void *objcache_alloc(struct objcache *oc);
+void objcache_free(struct objcache *oc, void *obj);
+
+/* Print statistics for every cache. */
+void objcache_printstats(void);
+
+#endif /* _OBJCACHE_H_ */
@@ -0,0 +1,60 @@
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+/*
+ * Unified page cache.
+ *
+ * File pages are kept in coremap frames keyed by (vnode, page-aligned
+ * offset) so that read, write and exec of the same file all share one
+ * in-memory copy. Frames are taken from free memory as the cache grows
+ * and handed back through the cache's shrinker when the VM system runs
+ * short.
+ *
+ * A page returned by pagecache_get is pinned and cannot be evicted
+ * until it is passed to pagecache_release. If pp_valid is false the
+ * caller must fill the frame from disk before using it. Callers
+ * serialize access to a given vnode's pages themselves (SFS uses
+ * the vfs big lock).
+ *
+ * Writes are expected to go through to disk, so cached pages are
+ * never dirty and can be dropped at any time when unpinned.
+ */
+
+#include <vm.h>
+
+struct vnode;
+
+struct pcpage {
+	struct vnode *pp_vnode;		/* file this page belongs to */
+	off_t pp_offset;		/* page-aligned offset in the file */
+	vaddr_t pp_kva;			/* kernel address of the frame */
+	unsigned pp_pincount;		/* active users; evictable if 0 */
+	bool pp_valid;			/* frame holds the file's data */
+	bool pp_orphan;			/* invalidated while pinned */
+	struct pcpage *pp_hashnext;	/* hash chain */
+	struct pcpage *pp_lruprev;	/* LRU list, most recent at head */
+	struct pcpage *pp_lrunext;
+};
+
+/* Initialization; call after vm_bootstrap. */
+void pagecache_bootstrap(void);
+
+/*
+ * Find (or create) the page of V at OFFSET and pin it. Returns NULL
+ * if no memory can be found for a new page.
+ */
+struct pcpage *pagecache_get(struct vnode *v, off_t offset);
+
+/*
+ * Unpin a page. If OK is false the caller failed to fill or update
+ * the frame and the page is thrown away.
+ */
+void pagecache_release(struct pcpage *pp, bool ok);
+
+/* Drop every page of V that holds any data at or beyond FROM. */
+void pagecache_invalidate(struct vnode *v, off_t from);
+
+/* Print statistics. */
+void pagecache_printstats(void);
+
+#endif /* _PAGECACHE_H_ */
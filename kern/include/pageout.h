@@ -0,0 +1,35 @@
+#ifndef _PAGEOUT_H_
+#define _PAGEOUT_H_
+
+/*
+ * Page-out daemon.
+ *
+ * A kernel thread that keeps some physical memory free so that
+ * allocations (and page faults) rarely have to reclaim memory
+ * themselves. The page allocator wakes it when the number of free
+ * pages drops below pageout_lowwater; it then asks the kernel caches
+ * to give memory back until pageout_highwater pages are free.
+ *
+ * Both watermarks are in pages. Read them freely; change them only
+ * with pageout_setwatermarks.
+ */
+
+extern unsigned pageout_lowwater;
+extern unsigned pageout_highwater;
+
+/* Start the daemon; call after vm_bootstrap. */
+void pageout_bootstrap(void);
+
+/* Wake the daemon if it's asleep. Callable from any context. */
+void pageout_wakeup(void);
+
+/*
+ * Set the watermarks. Returns EINVAL unless low < high and high is at
+ * most the number of pages of memory.
+ */
+int pageout_setwatermarks(unsigned low, unsigned high);
+
+/* Print the watermarks and statistics. */
+void pageout_printstats(void);
+
+#endif /* _PAGEOUT_H_ */
@@ -60,6 +60,9 @@ struct procWchan
     volatile char procStatus;
 
     volatile bool needProc;
+
+    //the live process with this pid, NULL once it's destroyed
+    struct proc *proc;
 };
 
 
@@ -73,6 +76,16 @@ void proc_freePid(pid_t pid);
 
 void proc_exitCodeNotNeeded(pid_t pid);
 
+//give proc its pid, so it can be looked up by it
+void proc_setPid(struct proc *proc, pid_t pid);
+
+//nice value (PRIO_MIN to PRIO_MAX) for fair-share scheduling
+int proc_setNice(pid_t pid, int nice);
+int proc_getNice(pid_t pid, int *nice);
+
+//print each process's share and cpu usage
+void proc_printShares(void);
+
 /*
  * Process structure.
  */
@@ -103,6 +116,18 @@ struct proc
 
     struct trapframe *initTf;
 
+    /*
+     * Fair share; protected by p_schedlock. The threads of a process
+     * share its cpu in proportion to p_weight. See thread.c.
+     * p_schedlock is a leaf: it is taken under the runqueue locks, so
+     * nothing may allocate, sleep, or wake anyone while holding it.
+     */
+    struct spinlock p_schedlock;
+    int p_nice;                 /* PRIO_MIN (most cpu) to PRIO_MAX */
+    unsigned p_weight;          /* from p_nice */
+    unsigned p_vruntime;        /* cpu time used, scaled by weight */
+    unsigned p_cputicks;        /* hardclocks used by all threads */
+
     /* add more material here as needed */
 };
 
@@ -0,0 +1,44 @@
+#ifndef _SHRINKER_H_
+#define _SHRINKER_H_
+
+/*
+ * Memory-pressure callbacks.
+ *
+ * A kernel cache that can give memory back registers a shrinker.
+ * When the page allocator runs short it calls shrink_caches, which
+ * asks each registered cache in turn to free memory until enough
+ * has been released.
+ *
+ * sh_count returns roughly how many pages the cache could free right
+ * now. sh_scan should free up to NPAGES pages' worth of objects and
+ * return how many pages' worth it actually freed; caches of objects
+ * smaller than a page do the conversion themselves. Both may be
+ * called from any context that can call kmalloc, so they must not
+ * sleep, and they must not allocate memory.
+ */
+
+struct shrinker {
+	const char *sh_name;
+	unsigned (*sh_count)(void *data);
+	unsigned (*sh_scan)(void *data, unsigned npages);
+	void *sh_data;
+
+	/* Private to shrinker.c */
+	struct shrinker *sh_next;
+	unsigned sh_busy;		/* callbacks running right now */
+};
+
+/*
+ * shrinker_unregister waits for any callbacks still running, so it
+ * must be called from thread context.
+ */
+void shrinker_register(struct shrinker *sh);
+void shrinker_unregister(struct shrinker *sh);
+
+/*
+ * Ask the registered caches to free NPAGES pages. Returns the number
+ * actually freed, which may be more or less than requested.
+ */
+unsigned shrink_caches(unsigned npages);
+
+#endif /* _SHRINKER_H_ */
@@ -53,16 +53,33 @@
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
+ *
+ * These are MCS queue locks: cpus waiting for the lock line up in
+ * order, and each one spins on a flag in its own struct spinnode
+ * until the cpu ahead of it passes the lock on. The lock word points
+ * at the last node in line, or is 0 if the lock is free. So the lock
+ * is granted first come first served, and a cpu spinning on it only
+ * reads its own node instead of the shared word.
  */
+struct spinnode {
+	struct spinnode *volatile sn_next; /* Next cpu in line. */
+	volatile bool sn_wait;		/* Cleared when it's our turn. */
+	bool sn_inuse;			/* Node is in line or holding. */
+};
+
+/* Nodes per cpu; this is how many spinlocks a cpu may hold at once. */
+#define SPINLOCK_NODES	16
+
 struct spinlock {
-	volatile spinlock_data_t lk_lock; /* The memory word where we spin. */
+	volatile spinlock_data_t lk_lock; /* The queue tail. */
+	struct spinnode *lk_node;	/* Holder's node. */
 	struct cpu *lk_holder;		/* CPU holding this lock. */
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL, NULL }
 
 /*
  * Spinlock functions.
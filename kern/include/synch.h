@@ -37,6 +37,11 @@
 
 #include <spinlock.h>
 
+struct timespec;	/* from <kern/time.h> */
+
+/* Initialization; call before creating any locks or CVs. */
+void synch_bootstrap(void);
+
 /*
  * Dijkstra-style semaphore.
  *
@@ -71,14 +76,23 @@ void V(struct semaphore *);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * The lock is adaptive: a thread that finds it held spins for a while
+ * if the holder is running on another cpu, since it will likely let
+ * go sooner than two context switches would take, and sleeps
+ * otherwise. A sleeper that wakes up only to find the lock taken again
+ * asks for a handoff; the next release then gives the lock straight to
+ * the thread it wakes instead of letting newcomers grab it first.
  */
 struct lock 
 {
     char *lk_name;
-    struct spinlock lk_lock;
+    struct spinlock lk_lock;            /* protects the rest */
     struct wchan *lk_wchan;
     volatile struct thread *lockedBy;
-        // (don't forget to mark things volatile as needed)
+    unsigned lk_waiters;                /* threads asleep on lk_wchan */
+    bool lk_handoff;                    /* reserved for the woken waiter */
+    bool lk_wanthandoff;                /* a woken waiter lost the race */
 };
 
 struct lock *lock_create(const char *name);
@@ -128,6 +142,9 @@ void cv_destroy(struct cv *);
  * Operations:
  *    cv_wait      - Release the supplied lock, go to sleep, and, after
  *                   waking up again, re-acquire the lock.
+ *    cv_timedwait - Like cv_wait, but give up once the time of day
+ *                   reaches ABSTIME. Returns 0, or ETIMEDOUT if the
+ *                   time ran out (the lock is held again either way).
  *    cv_signal    - Wake up one thread that's sleeping on this CV.
  *    cv_broadcast - Wake up all threads sleeping on this CV.
  *
@@ -138,8 +155,83 @@ void cv_destroy(struct cv *);
  * These operations must be atomic. You get to write them.
  */
 void cv_wait(struct cv *cv, struct lock *lock);
+int cv_timedwait(struct cv *cv, struct lock *lock,
+                 const struct timespec *abstime);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers may hold the lock at once, or one writer. A
+ * thread that wants to read waits while a writer holds the lock or is
+ * waiting for it, so a steady stream of readers can't keep writers
+ * out. What happens when a writer lets go depends on the policy given
+ * to rwlock_create:
+ *
+ *    RWLOCK_WRITERS - another waiting writer goes next; readers get in
+ *                     once no writers are waiting. Writes are never
+ *                     held up, but readers can starve under a steady
+ *                     stream of writes.
+ *    RWLOCK_FAIR    - all readers waiting at that point go next, then
+ *                     the next writer. Readers and writers take turns
+ *                     and neither can starve.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+#define RWLOCK_WRITERS  0
+#define RWLOCK_FAIR     1
+
+struct rwlock {
+	char *rw_name;
+	unsigned rw_policy;		/* RWLOCK_WRITERS or RWLOCK_FAIR */
+	struct spinlock rw_lock;	/* protects the rest */
+	struct wchan *rw_rwchan;	/* readers wait here */
+	struct wchan *rw_wwchan;	/* writers and upgraders wait here */
+	volatile struct thread *rw_writer;	/* holding for write */
+	unsigned rw_readers;		/* holding for read */
+	unsigned rw_rwaiting;		/* readers asleep */
+	unsigned rw_wwaiting;		/* writers asleep */
+	unsigned rw_rgen;		/* bumped when readers are let in */
+	bool rw_upgrading;		/* a reader is waiting to upgrade */
+};
+
+struct rwlock *rwlock_create(const char *name, unsigned policy);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read   - Get the lock for reading.
+ *    rwlock_release_read   - Give up a read hold.
+ *    rwlock_acquire_write  - Get the lock for writing.
+ *    rwlock_release_write  - Give up a write hold.
+ *    rwlock_upgrade        - Turn a read hold into a write hold, once
+ *                            the other readers are gone. Only one
+ *                            reader can wait to upgrade; if another
+ *                            already is, returns false and the caller
+ *                            still holds the lock for reading (and
+ *                            should release it and acquire for write,
+ *                            to avoid deadlock). Returns true once
+ *                            upgraded. Upgraders go ahead of waiting
+ *                            writers.
+ *    rwlock_downgrade      - Turn a write hold into a read hold, without
+ *                            letting any writer in between.
+ *    rwlock_do_i_hold_write - True if the current thread holds the lock
+ *                            for writing.
+ *    rwlock_held           - True if anyone holds the lock at all.
+ *                            Readers aren't tracked individually, so
+ *                            this is the best assertion a reader gets.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_upgrade(struct rwlock *);
+void rwlock_downgrade(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+bool rwlock_held(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
@@ -57,6 +57,11 @@ void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(userptr_t user_req, userptr_t user_rem);
+int sys_setaffinity(unsigned mask);
+int sys_getaffinity(userptr_t user_mask);
+int sys_setpriority(int which, pid_t who, int prio);
+int sys_getpriority(int which, pid_t who, int *retval);
 
 #ifdef UW
 int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
@@ -64,6 +64,20 @@ typedef enum {
 	S_ZOMBIE,	/* zombie; exited but not yet deleted */
 } threadstate_t;
 
+/* Names up to this long (with the NUL) are stored in the thread. */
+#define THREAD_NAMESIZE  32
+
+/*
+ * Scheduling classes. Real-time threads run ahead of all time-sharing
+ * threads, first come first served, until they block or yield; see
+ * thread_tick for the limit on how much of the cpu they may take.
+ */
+#define SCHED_OTHER  0	/* time-sharing, multi-level feedback */
+#define SCHED_FIFO   1	/* real-time */
+
+/* Affinity mask allowing every cpu. */
+#define THREAD_AFFINITY_ALL  0xffffffff
+
 /* Thread structure. */
 struct thread {
 	/*
@@ -71,6 +85,7 @@ struct thread {
 	 * debugger is messed up.
 	 */
 	char *t_name;			/* Name of this thread */
+	char t_namebuf[THREAD_NAMESIZE]; /* Storage for short names */
 	const char *t_wchan_name;	/* Name of wait channel, if sleeping */
 	threadstate_t t_state;		/* State this thread is in */
 
@@ -83,6 +98,7 @@ struct thread {
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
+	struct wchan *t_wchan;		/* Channel sleeping on, if any */
 
 	/*
 	 * Interrupt state fields.
@@ -100,11 +116,28 @@ struct thread {
 	bool t_in_interrupt;		/* Are we in an interrupt? */
 	int t_curspl;			/* Current spl*() state */
 	int t_iplhigh_count;		/* # of times IPL has been raised */
+	int t_nopreempt;		/* # of thread_preempt_disable calls */
+
+	/*
+	 * Scheduler fields. While the thread is on a run queue these
+	 * are protected by its cpu's run queue lock; otherwise only
+	 * the thread itself touches them.
+	 */
+	unsigned t_policy;		/* SCHED_OTHER or SCHED_FIFO */
+	unsigned t_priority;		/* Feedback queue level; 0 is highest */
+	unsigned t_ticksleft;		/* Hardclocks left in this quantum */
+	unsigned t_lastran;		/* t_cpu's c_hardclocks when last run */
+	uint32_t t_affinity;		/* Bit N set: may run on cpu N */
+	uint32_t t_readysince;		/* clock_usec() when made runnable */
+	uint32_t t_runsince;		/* clock_usec() when last run */
+					/* (both 0 if timing was off) */
 
 	/*
 	 * Public fields
 	 */
 
+	bool t_inshrink;		/* Running shrinkers; see shrinker.c */
+
 	/* add more here as needed */
 };
 
@@ -144,6 +177,14 @@ int thread_fork(const char *name, struct proc *proc,
                 void (*func)(void *, unsigned long),
                 void *data1, unsigned long data2);
 
+/*
+ * Like thread_fork, but the new thread is in the real-time class.
+ * Meant for kernel threads that service devices or run daemons.
+ */
+int thread_fork_rt(const char *name, struct proc *proc,
+                   void (*func)(void *, unsigned long),
+                   void *data1, unsigned long data2);
+
 /*
  * Cause the current thread to exit.
  * Interrupts need not be disabled.
@@ -157,6 +198,14 @@ void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Charge the current thread for one hardclock, and ask for a
+ * reschedule if its quantum is used up or a higher-priority thread
+ * is waiting. Called from the timer interrupt; the switch happens as
+ * the interrupt returns (see thread_preempt_intr).
+ */
+void thread_tick(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
@@ -168,5 +217,56 @@ void schedule(void);
  */
 void thread_consider_migration(void);
 
+/*
+ * Set the current thread's cpu affinity mask. Bit N set means the
+ * thread may run on cpu N. (Cpus numbered 32 and up are always
+ * allowed.) If the current cpu is no longer allowed the thread is
+ * moved. Fails with EINVAL if the mask allows no existing cpu.
+ * Forked threads inherit the mask.
+ */
+int thread_setaffinity(uint32_t mask);
+
+/*
+ * Fair-share weight for a process at the given nice value (PRIO_MIN
+ * to PRIO_MAX; out of range values are clamped). Nice 0 is 1024.
+ */
+unsigned thread_niceweight(int nice);
+
+/*
+ * Kernel preemption.
+ *
+ * A thread is preempted when an interrupt arrives while it could
+ * have been (interrupts on, so no spinlocks held) and the scheduler
+ * has asked for the cpu back: its quantum ran out, or the interrupt
+ * woke a thread that should run first. thread_preempt_disable and
+ * thread_preempt_enable mark a section that must not be preempted,
+ * for example because it uses per-cpu data, without turning
+ * interrupts off; they nest. Any pending preemption happens when the
+ * outermost section ends.
+ *
+ * Long loops in the kernel should call thread_preempt_point now and
+ * then. It gives up the cpu if a reschedule is pending, which
+ * catches wakeups done from thread context without waiting for the
+ * next interrupt.
+ */
+void thread_preempt_disable(void);
+void thread_preempt_enable(void);
+void thread_preempt_point(void);
+
+/* Called at the end of an interrupt that arrived with interrupts on. */
+void thread_preempt_intr(void);
+
+/* Print per-cpu scheduler statistics. */
+void thread_printstats(void);
+
+/*
+ * Print per-cpu context switch counts and latency histograms. The
+ * histograms and idle time are only kept while timing is switched on
+ * with thread_settiming; it's off by default, since it reads the clock
+ * on every switch.
+ */
+void thread_printlatency(void);
+void thread_settiming(bool on);
+
 
 #endif /* _THREAD_H_ */
@@ -0,0 +1,61 @@
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+/*
+ * Kernel timers.
+ *
+ * A timer calls a function once a given number of hardclocks have
+ * gone by. Each cpu keeps its pending timers in a hierarchical
+ * timing wheel: four levels of 64 slots, where level N holds timers
+ * due within 64^(N+1) ticks. Every tick runs the one level-0 slot
+ * that is due, and every 64 ticks a slot of the next level up is
+ * redistributed into the levels below, so both adding a timer and
+ * the work done per tick take constant time.
+ *
+ * Timers run on the cpu that added them, from hardclock, with
+ * interrupts off and that cpu's wheel locked. The function must not
+ * sleep, and must not add or cancel timers. timer_cancel waits for
+ * a running function to finish, so once it returns the timer is no
+ * longer in use and may be freed.
+ *
+ * The caller provides the storage for struct timer.
+ */
+
+struct cpu;
+struct timerwheel;
+
+struct timer {
+	struct timer *tmr_next;		/* slot list */
+	struct timer **tmr_pprev;	/* pointer to us in the slot list */
+	struct cpu *tmr_cpu;		/* wheel we're on; NULL if idle */
+	unsigned tmr_expires;		/* hardclock count when due */
+	unsigned tmr_level;		/* wheel level we're on */
+	void (*tmr_func)(void *data);
+	void *tmr_data;
+};
+
+/* Longest delay, in hardclocks; longer ones are shortened to this. */
+#define TIMER_MAXTICKS  ((1U << 24) - 1)
+
+/* Set up and clean up a cpu's timing wheel. */
+struct timerwheel *timerwheel_create(void);
+void timerwheel_destroy(struct timerwheel *tw);
+
+void timer_init(struct timer *tm, void (*func)(void *data), void *data);
+
+/* Run TM's function TICKS hardclocks from now, on this cpu. */
+void timer_add(struct timer *tm, unsigned ticks);
+
+/* Stop TM. Returns true if it was still pending. */
+bool timer_cancel(struct timer *tm);
+
+/* Called from hardclock to run the timers that have come due. */
+void timer_hardclock(void);
+
+/*
+ * Hardclocks until this cpu's next timer might be due, or LIMIT if
+ * that's sooner. Used to decide how long an idle cpu may sleep.
+ */
+unsigned timer_nextdelay(unsigned limit);
+
+#endif /* _TIMER_H_ */
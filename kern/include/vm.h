@@ -55,6 +55,21 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
+/*
+ * Allocate/free virtually contiguous kernel memory that need not be
+ * physically contiguous. Not for thread stacks.
+ */
+void *vmalloc(size_t sz);
+void vfree(void *ptr);
+
+/* Back-pointer from a kernel page to whoever owns it */
+void kpage_setowner(vaddr_t addr, void *owner);
+void *kpage_getowner(vaddr_t addr);
+
+/* Current number of free physical pages, and all managed pages */
+unsigned vm_freepages(void);
+unsigned vm_totalpages(void);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
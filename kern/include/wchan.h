@@ -37,6 +37,9 @@
 
 struct wchan; /* Opaque */
 
+/* Initialization; call before creating any wait channels. */
+void wchan_bootstrap(void);
+
 /*
  * Create a wait channel. Use NAME as a symbolic name for the channel.
  * NAME should be a string constant; if not, the caller is responsible
@@ -49,6 +52,12 @@ struct wchan *wchan_create(const char *name);
  */
 void wchan_destroy(struct wchan *wc);
 
+/*
+ * Rename a wait channel. The same rules apply to NAME as for
+ * wchan_create.
+ */
+void wchan_setname(struct wchan *wc, const char *name);
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -71,6 +80,12 @@ void wchan_unlock(struct wchan *wc);
  */
 void wchan_sleep(struct wchan *wc);
 
+/*
+ * Like wchan_sleep, but give up after TICKS hardclocks. Returns 0 if
+ * awakened or ETIMEDOUT if the time ran out.
+ */
+int wchan_sleep_timeout(struct wchan *wc, unsigned ticks);
+
 /*
  * Wake up one thread, or all threads, sleeping on a wait channel.
  * The queue should not already be locked.
@@ -0,0 +1,74 @@
+#ifndef _WORKQUEUE_H_
+#define _WORKQUEUE_H_
+
+/*
+ * Deferred work.
+ *
+ * A work item is a function to call later, in thread context, from a
+ * kernel worker thread. Each cpu has its own worker and its own queue
+ * of pending work; an item runs on the cpu that queued it, in the
+ * order queued. Work functions may sleep, but a long-running one
+ * holds up everything queued behind it on that cpu.
+ *
+ * The caller provides the storage for struct work, so queueing work
+ * never allocates and may be done from interrupt handlers. An item is
+ * pending from when it's queued until its function starts; queueing
+ * a pending item again does nothing. Once the function has started
+ * the item may be queued again, or freed (by the function itself,
+ * too).
+ *
+ * work_cancel and workqueue_flush wait for work functions to finish,
+ * so they may only be called from thread context, and not from a work
+ * function.
+ */
+
+#include <spinlock.h>
+#include <timer.h>
+
+struct workpool;
+
+struct work {
+	struct spinlock w_lock;		/* protects w_pending and w_pool */
+	bool w_pending;			/* queued or waiting on w_timer */
+	struct workpool *w_pool;	/* pool last queued on */
+	struct work *w_next;		/* pool queue; protected by pool */
+	struct timer w_timer;		/* for work_enqueue_delayed */
+	void (*w_func)(void *data);
+	void *w_data;
+};
+
+/* Set up and clean up the worker pool for cpu number CPUNUM. */
+struct workpool *workpool_create(unsigned cpunum);
+void workpool_destroy(struct workpool *wp);
+
+/* Start the worker threads. Call once the other cpus are running. */
+void workqueue_bootstrap(void);
+
+void work_init(struct work *w, void (*func)(void *data), void *data);
+void work_cleanup(struct work *w);
+
+/*
+ * Queue W to run on this cpu. Returns false if it was already
+ * pending.
+ */
+bool work_enqueue(struct work *w);
+
+/* Same, but queue it only once TICKS hardclocks have gone by. */
+bool work_enqueue_delayed(struct work *w, unsigned ticks);
+
+/*
+ * Take W off the queue if it's pending and wait for it to finish if
+ * it's running. Returns true if a pending run was cancelled.
+ */
+bool work_cancel(struct work *w);
+
+/*
+ * Wait until all work queued (not counting delayed work still
+ * waiting on its timer) before the call has finished.
+ */
+void workqueue_flush(void);
+
+/* Print per-cpu worker statistics. */
+void workqueue_printstats(void);
+
+#endif /* _WORKQUEUE_H_ */
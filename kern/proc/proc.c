@@ -50,6 +50,7 @@
 #include <vfs.h>
 #include <synch.h>
 #include <wchan.h>
+#include <objcache.h>
 #include <kern/fcntl.h>
 #include <kern/limits.h>
 #include <kern/errno.h>
@@ -81,34 +82,53 @@ static const unsigned int MAX_PID_SIZE = __PID_MAX-__PID_MIN + 1;
  * pid
  */
 static int pidCounter;
-static struct lock *pidListLock;
+static struct rwlock *pidListLock;
 
 /*
  * wchan for each pid
  */
 struct procWchan *procWchans[__PID_MAX-__PID_MIN + 1];
 
+static struct objcache *proc_cache;
+static struct objcache *procWchan_cache;
+
+/*
+ * procWchans keep their wait channel while sitting in procWchan_cache.
+ */
+static int procWchan_ctor(void *obj)
+{
+    struct procWchan *pw = obj;
+
+    pw->pwchan = wchan_create("pwchan");
+    if(pw->pwchan == NULL)
+    {
+        return ENOMEM;
+    }
+    return 0;
+}
+
+static void procWchan_dtor(void *obj)
+{
+    struct procWchan *pw = obj;
+
+    wchan_destroy(pw->pwchan);
+}
+
 struct procWchan *procWchan_create()
 {
     struct procWchan * pw;
 
-    pw = kmalloc(sizeof(struct procWchan));
+    pw = objcache_alloc(procWchan_cache);
     if(pw == NULL)
     {
         return NULL;
     }
     
-    pw->pwchan = wchan_create("pwchan");
-    if(pw->pwchan == NULL)
-    {
-        kfree(pw);
-        return NULL;
-    }
-    
     pw->exitcode = -2;
     pw->exitstate = -1;
     pw->procStatus = -1;
     pw->needProc = 1;
+    pw->proc = NULL;
 
     return pw;
 }
@@ -119,42 +139,43 @@ void procWchan_destroy(struct procWchan *pw)
     {
         return;
     }
-    wchan_destroy(pw->pwchan);
-    kfree(pw);
+    KASSERT(wchan_isempty(pw->pwchan));
+    objcache_free(procWchan_cache, pw);
 }
 
 void proc_exitCodeNotNeeded(pid_t pid)
 {
-    if(procWchans[pid-__PID_MIN] == NULL)
+    rwlock_acquire_write(pidListLock);
+    if(procWchans[pid-__PID_MIN] != NULL)
     {
-        return;
+        procWchans[pid-__PID_MIN]->needProc = 0;
     }
-
-    lock_acquire(pidListLock);
-    procWchans[pid-__PID_MIN]->needProc = 0;
-    lock_release(pidListLock);
+    rwlock_release_write(pidListLock);
 }
 
+//give the pid back if nobody will wait for it; the slot is cleared so
+//lookups can't reach the freed procWchan
 void proc_freePid(pid_t pid)
 {
-
-    if(procWchans[pid-__PID_MIN] == NULL)
+    if(pid < __PID_MIN || pid > __PID_MAX)
     {
         return;
     }
 
-    if(!procWchans[pid-__PID_MIN]->needProc)
+    rwlock_acquire_write(pidListLock);
+    if(procWchans[pid-__PID_MIN] != NULL &&
+       !procWchans[pid-__PID_MIN]->needProc)
     {
-        lock_acquire(pidListLock);
         procWchan_destroy(procWchans[pid-__PID_MIN]);
-        lock_release(pidListLock);
+        procWchans[pid-__PID_MIN] = NULL;
     }
+    rwlock_release_write(pidListLock);
 }
 
 
 int proc_getAndCreateNewPid(pid_t *ret)
 {
-    lock_acquire(pidListLock);
+    rwlock_acquire_write(pidListLock);
     int error = 0;
     pid_t pid= -1;
     int counter = pidCounter;
@@ -189,7 +210,7 @@ int proc_getAndCreateNewPid(pid_t *ret)
         *ret = pid + __PID_MIN;
     }
 
-    lock_release(pidListLock);
+    rwlock_release_write(pidListLock);
     return error;
 }
 
@@ -206,6 +227,39 @@ int copyInitTrapframe(struct proc *proc, struct trapframe* tf)
 }
 
 
+/*
+ * Object cache constructor and destructor for struct proc. These set
+ * up the parts that proc_destroy leaves empty: the thread array, the
+ * spinlock and the (empty) child pid array.
+ */
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	proc->childPids = array_create();
+	if (proc->childPids == NULL) {
+		return ENOMEM;
+	}
+	threadarray_init(&proc->p_threads);
+	spinlock_init(&proc->p_lock);
+	spinlock_init(&proc->p_schedlock);
+	return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_cleanup(&proc->p_threads);
+	spinlock_cleanup(&proc->p_schedlock);
+	spinlock_cleanup(&proc->p_lock);
+	array_destroy(proc->childPids);
+}
+
 /*
  * Create a proc structure.
  */
@@ -215,19 +269,16 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = objcache_alloc(proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		objcache_free(proc_cache, proc);
 		return NULL;
 	}
 
-	threadarray_init(&proc->p_threads);
-	spinlock_init(&proc->p_lock);
-
 	/* VM fields */
 	proc->p_addrspace = NULL;
 
@@ -240,10 +291,13 @@ proc_create(const char *name)
 
         proc->pid = 0;
 
-        proc->childPids = array_create();
-
         proc->initTf = NULL;
 
+        proc->p_nice = 0;
+        proc->p_weight = thread_niceweight(0);
+        proc->p_vruntime = 0;
+        proc->p_cputicks = 0;
+
 	return proc;
 }
 
@@ -271,7 +325,13 @@ proc_destroy(struct proc *proc)
         }
 
 
-        lock_acquire(pidListLock);
+        rwlock_acquire_write(pidListLock);
+        //nobody can look this process up any more
+        if(proc->pid >= __PID_MIN && procWchans[proc->pid-__PID_MIN] != NULL)
+        {
+            procWchans[proc->pid-__PID_MIN]->proc = NULL;
+        }
+
         //Manage child pid //
         for (unsigned i = 0; i < array_num(proc->childPids); i++)
         {
@@ -288,7 +348,7 @@ proc_destroy(struct proc *proc)
             }
 
         }
-        lock_release(pidListLock);
+        rwlock_release_write(pidListLock);
 
         
         //remove child pid array
@@ -303,7 +363,7 @@ proc_destroy(struct proc *proc)
         proc_freePid(proc->pid);
         
 
-        array_destroy(proc->childPids);
+        /* childPids is now empty and goes back to proc_cache with proc */
 
         ////
 
@@ -348,11 +408,10 @@ proc_destroy(struct proc *proc)
 	}
 #endif // UW
 
-	threadarray_cleanup(&proc->p_threads);
-	spinlock_cleanup(&proc->p_lock);
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
 
 	kfree(proc->p_name);
-	kfree(proc);
+	objcache_free(proc_cache, proc);
 
 #ifdef UW
 	/* decrement the process count */
@@ -376,6 +435,14 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+  proc_cache = objcache_create("proc", sizeof(struct proc),
+			       proc_ctor, proc_dtor);
+  procWchan_cache = objcache_create("procWchan", sizeof(struct procWchan),
+				    procWchan_ctor, procWchan_dtor);
+  if (proc_cache == NULL || procWchan_cache == NULL) {
+    panic("could not create proc object caches\n");
+  }
+
   kproc = proc_create("[kernel]");
   if (kproc == NULL) {
     panic("proc_create for kproc failed\n");
@@ -394,9 +461,9 @@ proc_bootstrap(void)
 #endif // UW 
 
   //pid
-  pidListLock = lock_create("pidListLock");
+  pidListLock = rwlock_create("pidListLock", RWLOCK_FAIR);
   if (pidListLock == NULL) {
-    panic("could not create pidListLock lock\n");
+    panic("could not create pidListLock rwlock\n");
   }
   pidCounter = 0;
 
@@ -442,6 +509,16 @@ proc_create_runprogram(const char *name)
 
 	proc->p_addrspace = NULL;
 
+        /*
+         * Fair share: children get their parent's nice value, and
+         * start where it is so that forking doesn't earn extra cpu.
+         */
+        spinlock_acquire(&parentProc->p_schedlock);
+        proc->p_nice = parentProc->p_nice;
+        proc->p_weight = parentProc->p_weight;
+        proc->p_vruntime = parentProc->p_vruntime;
+        spinlock_release(&parentProc->p_schedlock);
+
 	/* VFS fields */
 
 #ifdef UW
@@ -473,6 +550,90 @@ proc_create_runprogram(const char *name)
 	return proc;
 }
 
+void proc_setPid(struct proc *proc, pid_t pid)
+{
+    KASSERT(procWchans[pid-__PID_MIN] != NULL);
+
+    rwlock_acquire_write(pidListLock);
+    proc->pid = pid;
+    procWchans[pid-__PID_MIN]->proc = proc;
+    rwlock_release_write(pidListLock);
+}
+
+//look up the live process with this pid; call with pidListLock held
+static struct proc *proc_lookup(pid_t pid)
+{
+    KASSERT(rwlock_held(pidListLock));
+
+    if(pid < __PID_MIN || pid > __PID_MAX)
+    {
+        return NULL;
+    }
+    if(procWchans[pid-__PID_MIN] == NULL)
+    {
+        return NULL;
+    }
+    return procWchans[pid-__PID_MIN]->proc;
+}
+
+int proc_setNice(pid_t pid, int nice)
+{
+    struct proc *proc;
+
+    rwlock_acquire_read(pidListLock);
+    proc = proc_lookup(pid);
+    if(proc == NULL)
+    {
+        rwlock_release_read(pidListLock);
+        return ESRCH;
+    }
+    spinlock_acquire(&proc->p_schedlock);
+    proc->p_nice = nice;
+    proc->p_weight = thread_niceweight(nice);
+    spinlock_release(&proc->p_schedlock);
+    rwlock_release_read(pidListLock);
+    return 0;
+}
+
+int proc_getNice(pid_t pid, int *nice)
+{
+    struct proc *proc;
+
+    rwlock_acquire_read(pidListLock);
+    proc = proc_lookup(pid);
+    if(proc == NULL)
+    {
+        rwlock_release_read(pidListLock);
+        return ESRCH;
+    }
+    *nice = proc->p_nice;
+    rwlock_release_read(pidListLock);
+    return 0;
+}
+
+static void proc_printShare(struct proc *proc)
+{
+    kprintf("%5d  %4d  %6u  %10u  %10u  %s\n",
+            proc->pid, proc->p_nice, proc->p_weight,
+            proc->p_cputicks, proc->p_vruntime, proc->p_name);
+}
+
+void proc_printShares(void)
+{
+    kprintf("  pid  nice  weight    cputicks    vruntime  name\n");
+    proc_printShare(kproc);
+
+    rwlock_acquire_read(pidListLock);
+    for(unsigned i = 0; i < MAX_PID_SIZE; ++i)
+    {
+        if(procWchans[i] != NULL && procWchans[i]->proc != NULL)
+        {
+            proc_printShare(procWchans[i]->proc);
+        }
+    }
+    rwlock_release_read(pidListLock);
+}
+
 void proc_addChildPid(struct proc *proc, pid_t cpid)
 {
     if(proc == NULL || proc == kproc)
@@ -593,7 +754,7 @@ int proc_waitOn(pid_t pid)
 {
     KASSERT(procWchans[pid-__PID_MIN] != NULL);
 
-    lock_acquire(pidListLock);
+    rwlock_acquire_read(pidListLock);
 
     if(procWchans[pid-__PID_MIN]->procStatus == 1)
     {
@@ -617,15 +778,15 @@ int proc_waitOn(pid_t pid)
             exitstatus = _MKWAIT_EXIT(exitcode);
         }
         
-        lock_release(pidListLock);
+        rwlock_release_read(pidListLock);
         return exitstatus;
     }
     
     wchan_lock(procWchans[pid-__PID_MIN]->pwchan);
-    lock_release(pidListLock);
+    rwlock_release_read(pidListLock);
     wchan_sleep(procWchans[pid-__PID_MIN]->pwchan);
 
-    lock_acquire(pidListLock);
+    rwlock_acquire_read(pidListLock);
     int exitstatus = 0;
     int exitstate = procWchans[pid-__PID_MIN]->exitstate;
     int exitcode = procWchans[pid-__PID_MIN]->exitcode;
@@ -645,7 +806,7 @@ int proc_waitOn(pid_t pid)
     {
         exitstatus = _MKWAIT_EXIT(exitcode);
     }
-    lock_release(pidListLock);
+    rwlock_release_read(pidListLock);
 
     return exitstatus;
 }
@@ -654,23 +815,23 @@ int proc_waitOn(pid_t pid)
 void proc_exitOn(pid_t pid,int exitcode,int exitstate)
 {
     KASSERT(procWchans[pid-__PID_MIN] != NULL);
-    lock_acquire(pidListLock);
+    rwlock_acquire_write(pidListLock);
     procWchans[pid-__PID_MIN]->procStatus = 1;
     procWchans[pid-__PID_MIN]->exitcode = exitcode;
     procWchans[pid-__PID_MIN]->exitstate = exitstate;
 
     wchan_wakeall(procWchans[pid-__PID_MIN]->pwchan);
 
-    lock_release(pidListLock);
+    rwlock_release_write(pidListLock);
 }
 
 //procWchans[pid-__PID_MIN] must not be NULL
 void proc_changeWaitStatus(pid_t pid, char status)
 {
     KASSERT(procWchans[pid-__PID_MIN] != NULL);
-    lock_acquire(pidListLock);
+    rwlock_acquire_write(pidListLock);
     procWchans[pid-__PID_MIN]->procStatus = status;
-    lock_release(pidListLock);
+    rwlock_release_write(pidListLock);
 }
 
 char proc_getWaitStatus(pid_t pid)
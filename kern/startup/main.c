@@ -42,7 +42,12 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <vm.h>
+#include <objcache.h>
+#include <pagecache.h>
+#include <pageout.h>
+#include <workqueue.h>
 #include <mainbus.h>
 #include <vfs.h>
 #include <device.h>
@@ -107,6 +112,9 @@ boot(void)
 
 	/* Early initialization. */
 	ram_bootstrap();
+	objcache_bootstrap();
+	wchan_bootstrap();
+	synch_bootstrap();
 	proc_bootstrap();
 	thread_bootstrap();
 	hardclock_bootstrap();
@@ -123,8 +131,12 @@ boot(void)
 
 	/* Late phase of initialization. */
 	vm_bootstrap();
+	kheap_bootstrap();
+	pagecache_bootstrap();
+	pageout_bootstrap();
 	kprintf_bootstrap();
 	thread_start_cpus();
+	workqueue_bootstrap();
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
 	vfs_setbootfs("emu0");
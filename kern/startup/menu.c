@@ -39,6 +39,11 @@
 #include <proc.h>
 #include <synch.h>
 #include <vfs.h>
+#include <vm.h>
+#include <pagecache.h>
+#include <objcache.h>
+#include <pageout.h>
+#include <workqueue.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
@@ -146,7 +151,7 @@ common_prog(int nargs, char **args)
             proc_destroy(proc);
             return ENPROC;
         }
-        proc->pid = cpid;
+        proc_setPid(proc,cpid);
         proc_exitCodeNotNeeded(cpid);
 
 	result = thread_fork(args[0] /* thread name */,
@@ -416,6 +421,150 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Command for the kernel heap profiler.
+ */
+static
+int
+cmd_kheapprof(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		result = kheap_profile_start();
+		if (result) {
+			kprintf("khp: %s\n", strerror(result));
+			return result;
+		}
+		return 0;
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		kheap_profile_stop();
+		return 0;
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: khp [on|off]\n");
+		return EINVAL;
+	}
+
+	kheap_profile_dump();
+
+	return 0;
+}
+
+static
+int
+cmd_schedstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_schedlatency(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		thread_settiming(true);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		thread_settiming(false);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: sl [on|off]\n");
+		return EINVAL;
+	}
+
+	thread_printlatency();
+
+	return 0;
+}
+
+static
+int
+cmd_pagecachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	pagecache_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_objcachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	objcache_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_procshares(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	proc_printShares();
+
+	return 0;
+}
+
+static
+int
+cmd_workqueuestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	workqueue_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for showing or setting the page-out daemon's watermarks.
+ */
+static
+int
+cmd_watermarks(int nargs, char **args)
+{
+	int low, high, result;
+
+	if (nargs == 3) {
+		low = atoi(args[1]);
+		high = atoi(args[2]);
+		if (low < 0 || high < 0) {
+			kprintf("wm: watermarks can't be negative\n");
+			return EINVAL;
+		}
+		result = pageout_setwatermarks(low, high);
+		if (result) {
+			kprintf("wm: low must be less than high, and high "
+				"at most %u\n", vm_totalpages());
+			return result;
+		}
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: wm [low high]\n");
+		return EINVAL;
+	}
+
+	pageout_printstats();
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -486,6 +635,8 @@ static const char *testmenu[] = {
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] Rwlock test                   ",
+	"[slb] Spinlock benchmark            ",
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -525,6 +676,14 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[khp] Kernel heap profile [on|off]  ",
+	"[pcs] Page cache stats              ",
+	"[ss] Scheduler stats                ",
+	"[sl] Scheduler latency              ",
+	"[fss] Fair-share usage              ",
+	"[ocs] Object cache stats            ",
+	"[wqs] Workqueue stats               ",
+	"[wm] Page-out watermarks            ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -581,6 +740,14 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "khp",	cmd_kheapprof },
+	{ "pcs",	cmd_pagecachestats },
+	{ "ss",		cmd_schedstats },
+	{ "sl",		cmd_schedlatency },
+	{ "fss",	cmd_procshares },
+	{ "ocs",	cmd_objcachestats },
+	{ "wqs",	cmd_workqueuestats },
+	{ "wm",		cmd_watermarks },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -598,6 +765,8 @@ static struct {
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	rwtest },
+	{ "slb",	spinlockbench },
 #ifdef UW
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
@@ -35,7 +35,7 @@ void sys__exit(int exitcode) {
    * messily fatal.
    */
   as = curproc_setas(NULL);
-  as_destroy(as);
+  as_destroy_later(as);
 
   /* detach this thread from its process */
   /* note: curproc cannot be used after this call */
@@ -129,7 +129,7 @@ int sys_fork(struct trapframe *tf,pid_t *retval)
         proc_destroy(childProc);
         return ENPROC;
     }
-    childProc->pid = cpid;
+    proc_setPid(childProc,cpid);
     proc_addChildPid(curproc,cpid);
 
     //create and copy child trapframe
@@ -209,7 +209,7 @@ int sys_execv(const char *progname, char **args, int *retval)
 
     //copy in args to argv
 
-    char **argv = (char **)kmalloc((argc + 1) * sizeof(char *));
+    char **argv = (char **)vmalloc((argc + 1) * sizeof(char *));
     if(argv == NULL)
     {
         kfree(pname);
@@ -228,7 +228,7 @@ int sys_execv(const char *progname, char **args, int *retval)
             {
                 kfree(argv[j]);
             }
-            kfree(argv);
+            vfree(argv);
             *retval = -1;
             return ENOMEM;
         }
@@ -240,7 +240,7 @@ int sys_execv(const char *progname, char **args, int *retval)
             {
                 kfree(argv[j]);
             }
-            kfree(argv);
+            vfree(argv);
             *retval = -1;
             return result;
         }        
@@ -257,7 +257,7 @@ int sys_execv(const char *progname, char **args, int *retval)
         {
             kfree(argv[i]);
         }
-        kfree(argv);
+        vfree(argv);
         *retval = -1;
         return result;
     }
@@ -271,7 +271,7 @@ int sys_execv(const char *progname, char **args, int *retval)
         {
             kfree(argv[i]);
         }
-        kfree(argv);
+        vfree(argv);
         vfs_close(v);
         *retval = -1;
         return ENOMEM;
@@ -288,7 +288,7 @@ int sys_execv(const char *progname, char **args, int *retval)
         {
             kfree(argv[i]);
         }
-        kfree(argv);
+        vfree(argv);
         as_deactivate();
         as = curproc_setas(oldas);
         as_destroy(as);
@@ -310,7 +310,7 @@ int sys_execv(const char *progname, char **args, int *retval)
         {
             kfree(argv[i]);
         }
-        kfree(argv);
+        vfree(argv);
         as_deactivate();
         as = curproc_setas(oldas);
         as_destroy(as);
@@ -321,14 +321,14 @@ int sys_execv(const char *progname, char **args, int *retval)
         
     /*------copy args to user stack-----------*/
 
-    vaddr_t *argPtrs = (vaddr_t *)kmalloc((argc + 1) * sizeof(vaddr_t));
+    vaddr_t *argPtrs = (vaddr_t *)vmalloc((argc + 1) * sizeof(vaddr_t));
     if(argPtrs == NULL)
     {
         for(int i = 0; i < argc; ++i)
         {
             kfree(argv[i]);
         }
-        kfree(argv);
+        vfree(argv);
         as_deactivate();
         as = curproc_setas(oldas);
         as_destroy(as);
@@ -351,12 +351,12 @@ int sys_execv(const char *progname, char **args, int *retval)
         result = copyout((void *) argv[i], (userptr_t)stackptr, curArgLen);
         if(result)
         {
-            kfree(argPtrs);
+            vfree(argPtrs);
             for(int i = 0; i < argc; ++i)
             {
                 kfree(argv[i]);
             }
-            kfree(argv);
+            vfree(argv);
             as_deactivate();
             as = curproc_setas(oldas);
             as_destroy(as);
@@ -376,12 +376,12 @@ int sys_execv(const char *progname, char **args, int *retval)
         result = copyout((void *) &argPtrs[i], ((userptr_t)stackptr),sizeof(vaddr_t));
         if(result)
         {
-            kfree(argPtrs);
+            vfree(argPtrs);
             for(int i = 0; i < argc; ++i)
             {
                 kfree(argv[i]);
             }
-            kfree(argv);
+            vfree(argv);
             as_deactivate();
             as = curproc_setas(oldas);
             as_destroy(as);
@@ -391,7 +391,7 @@ int sys_execv(const char *progname, char **args, int *retval)
     }
     
     
-    kfree(argPtrs);
+    vfree(argPtrs);
 
 
 
@@ -422,10 +422,10 @@ int sys_execv(const char *progname, char **args, int *retval)
     {
         kfree(argv[i]);
     }
-    kfree(argv);
+    vfree(argv);
     
     as_deactivate();
-    as_destroy(oldas);
+    as_destroy_later(oldas);
     as_activate();
     
     *retval = 0;
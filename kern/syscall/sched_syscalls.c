@@ -0,0 +1,65 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/resource.h>
+#include <copyinout.h>
+#include <current.h>
+#include <thread.h>
+#include <proc.h>
+#include <syscall.h>
+
+/*
+ * Scheduling system calls. User processes have one thread, so the
+ * affinity calls act on the calling thread.
+ */
+
+int
+sys_setaffinity(unsigned mask)
+{
+	return thread_setaffinity(mask);
+}
+
+int
+sys_getaffinity(userptr_t user_mask)
+{
+	unsigned mask;
+
+	mask = curthread->t_affinity;
+	return copyout(&mask, user_mask, sizeof(mask));
+}
+
+/*
+ * Priorities are nice values, which set a process's fair share of
+ * the cpu. There are no process groups or users, so only
+ * PRIO_PROCESS is accepted; WHO 0 means the caller. Out of range
+ * values are clamped, as in BSD.
+ */
+int
+sys_setpriority(int which, pid_t who, int prio)
+{
+	if (which != PRIO_PROCESS) {
+		return EINVAL;
+	}
+	if (who == 0) {
+		who = curproc->pid;
+	}
+	if (prio < PRIO_MIN) {
+		prio = PRIO_MIN;
+	}
+	if (prio > PRIO_MAX) {
+		prio = PRIO_MAX;
+	}
+	return proc_setNice(who, prio);
+}
+
+int
+sys_getpriority(int which, pid_t who, int *retval)
+{
+	if (which != PRIO_PROCESS) {
+		return EINVAL;
+	}
+	if (who == 0) {
+		who = curproc->pid;
+	}
+	return proc_getNice(who, retval);
+}
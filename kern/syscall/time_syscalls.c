@@ -28,6 +28,8 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
+#include <kern/time.h>
 #include <clock.h>
 #include <copyinout.h>
 #include <syscall.h>
@@ -56,3 +58,45 @@ sys___time(userptr_t user_seconds_ptr, userptr_t user_nanoseconds_ptr)
 
 	return 0;
 }
+
+/*
+ * Sleep for the interval in USER_REQ. There are no signals to cut
+ * the sleep short, so the time left over is always zero.
+ */
+int
+sys_nanosleep(userptr_t user_req, userptr_t user_rem)
+{
+	struct timespec req, when;
+	time_t seconds;
+	uint32_t nanoseconds;
+	int result;
+
+	result = copyin(user_req, &req, sizeof(req));
+	if (result) {
+		return result;
+	}
+	if (req.tv_sec < 0 || req.tv_nsec < 0 || req.tv_nsec >= 1000000000) {
+		return EINVAL;
+	}
+
+	gettime(&seconds, &nanoseconds);
+	when.tv_sec = seconds + req.tv_sec;
+	when.tv_nsec = nanoseconds + req.tv_nsec;
+	if (when.tv_nsec >= 1000000000) {
+		when.tv_sec++;
+		when.tv_nsec -= 1000000000;
+	}
+
+	thread_sleep_until(&when);
+
+	if (user_rem != NULL) {
+		req.tv_sec = 0;
+		req.tv_nsec = 0;
+		result = copyout(&req, user_rem, sizeof(req));
+		if (result) {
+			return result;
+		}
+	}
+
+	return 0;
+}
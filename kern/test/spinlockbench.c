@@ -0,0 +1,203 @@
+/*
+ * Spinlock contention benchmark.
+ *
+ * Several threads, one per cpu as far as there are cpus, hammer on a
+ * single lock, first with a plain test-and-test-and-set spinlock (how
+ * spinlocks used to work) and then with the MCS queue spinlock. For
+ * each we report how fast the lock changed hands and how evenly it was
+ * shared: with an unfair lock some threads get it far more often than
+ * others.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <clock.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+#define BENCH_MAXTHREADS  32
+#define BENCH_DEFTHREADS  4
+#define BENCH_ACQUIRES    20000	/* total, across all threads */
+#define BENCH_HOLD        20	/* loop iterations inside the lock */
+#define BENCH_THINK       50	/* loop iterations between acquires */
+
+/*
+ * Test-and-test-and-set lock, as spinlock_acquire used to do it.
+ */
+struct ttaslock {
+	volatile spinlock_data_t tl_lock;
+};
+
+static
+void
+ttas_acquire(struct ttaslock *tl)
+{
+	splraise(IPL_NONE, IPL_HIGH);
+	while (1) {
+		if (spinlock_data_get(&tl->tl_lock) != 0) {
+			continue;
+		}
+		if (spinlock_data_testandset(&tl->tl_lock) != 0) {
+			continue;
+		}
+		break;
+	}
+}
+
+static
+void
+ttas_release(struct ttaslock *tl)
+{
+	spinlock_data_set(&tl->tl_lock, 0);
+	spllower(IPL_HIGH, IPL_NONE);
+}
+
+static struct ttaslock bench_ttas;
+static struct spinlock bench_mcs;
+static bool bench_usemcs;
+
+static volatile bool bench_go;
+static volatile unsigned bench_total;
+static volatile unsigned bench_shared;
+static unsigned bench_counts[BENCH_MAXTHREADS];
+static struct semaphore *bench_donesem;
+
+static
+void
+bench_lock(void)
+{
+	if (bench_usemcs) {
+		spinlock_acquire(&bench_mcs);
+	}
+	else {
+		ttas_acquire(&bench_ttas);
+	}
+}
+
+static
+void
+bench_unlock(void)
+{
+	if (bench_usemcs) {
+		spinlock_release(&bench_mcs);
+	}
+	else {
+		ttas_release(&bench_ttas);
+	}
+}
+
+static
+void
+bench_thread(void *junk, unsigned long num)
+{
+	volatile unsigned i;
+	bool done;
+
+	(void)junk;
+
+	/* Spread out over the cpus; if there aren't that many, fine. */
+	thread_setaffinity((uint32_t)1 << (num % 32));
+
+	while (!bench_go) {
+		thread_yield();
+	}
+
+	do {
+		bench_lock();
+		done = bench_total >= BENCH_ACQUIRES;
+		if (!done) {
+			bench_total++;
+			bench_counts[num]++;
+			for (i=0; i<BENCH_HOLD; i++) {
+				bench_shared++;
+			}
+		}
+		bench_unlock();
+		for (i=0; i<BENCH_THINK; i++) {
+			/* think */
+		}
+	} while (!done);
+
+	V(bench_donesem);
+}
+
+static
+void
+bench_run(const char *name, bool usemcs, unsigned nthreads)
+{
+	unsigned i, min, max;
+	uint32_t start, usecs;
+	int result;
+
+	bench_usemcs = usemcs;
+	bench_go = false;
+	bench_total = 0;
+	for (i=0; i<nthreads; i++) {
+		bench_counts[i] = 0;
+	}
+
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("spinlockbench", NULL, bench_thread,
+				     NULL, i);
+		if (result) {
+			panic("spinlockbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	start = clock_usec();
+	bench_go = true;
+	for (i=0; i<nthreads; i++) {
+		P(bench_donesem);
+	}
+	usecs = clock_usec() - start;
+
+	min = max = bench_counts[0];
+	for (i=1; i<nthreads; i++) {
+		if (bench_counts[i] < min) {
+			min = bench_counts[i];
+		}
+		if (bench_counts[i] > max) {
+			max = bench_counts[i];
+		}
+	}
+
+	kprintf("%-6s %10u %10u %10u %10u %10u\n", name, BENCH_ACQUIRES,
+		usecs, usecs == 0 ? 0 : BENCH_ACQUIRES * 1000 / usecs,
+		min, max);
+}
+
+int
+spinlockbench(int nargs, char **args)
+{
+	unsigned nthreads;
+
+	nthreads = BENCH_DEFTHREADS;
+	if (nargs > 1) {
+		nthreads = atoi(args[1]);
+	}
+	if (nthreads < 1 || nthreads > BENCH_MAXTHREADS) {
+		kprintf("Usage: slb [threads]  (1-%u)\n", BENCH_MAXTHREADS);
+		return EINVAL;
+	}
+
+	bench_donesem = sem_create("spinlockbench", 0);
+	if (bench_donesem == NULL) {
+		return ENOMEM;
+	}
+	spinlock_data_set(&bench_ttas.tl_lock, 0);
+	spinlock_init(&bench_mcs);
+
+	kprintf("Spinlock benchmark, %u threads\n", nthreads);
+	kprintf("%-6s %10s %10s %10s %10s %10s\n", "lock", "acquires",
+		"usecs", "acq/msec", "min/thread", "max/thread");
+	bench_run("ttas", false, nthreads);
+	bench_run("mcs", true, nthreads);
+
+	spinlock_cleanup(&bench_mcs);
+	sem_destroy(bench_donesem);
+	return 0;
+}
@@ -33,6 +33,7 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spinlock.h>
 #include <clock.h>
 #include <thread.h>
 #include <synch.h>
@@ -41,6 +42,7 @@
 #define NSEMLOOPS     63
 #define NLOCKLOOPS    120
 #define NCVLOOPS      5
+#define NRWLOOPS      60
 #define NTHREADS      32
 
 static volatile unsigned long testval1;
@@ -347,3 +349,213 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Reader-writer lock test. A quarter of the threads write, a quarter
+ * read and then try to upgrade and downgrade, and the rest just read.
+ * Writers must have the lock to themselves, readers must never see a
+ * half-done write, and with this many readers some of them should
+ * end up holding the lock at the same time. Runs once per policy.
+ */
+
+static struct rwlock *testrw;
+static struct semaphore *rwdonesem;
+static struct spinlock rwstats_lock = SPINLOCK_INITIALIZER;
+static volatile unsigned rwreaders;	/* threads inside for read */
+static volatile unsigned rwwriters;	/* threads inside for write */
+static unsigned rwmaxreaders;
+static unsigned rwupgrades;
+static bool rwfailed;
+
+static
+void
+rwfail(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: %s\n", num, msg);
+	rwfailed = true;
+}
+
+static
+void
+rwenter_read(unsigned long num)
+{
+	spinlock_acquire(&rwstats_lock);
+	if (rwwriters != 0) {
+		rwfail(num, "reading while a writer is inside");
+	}
+	rwreaders++;
+	if (rwreaders > rwmaxreaders) {
+		rwmaxreaders = rwreaders;
+	}
+	spinlock_release(&rwstats_lock);
+}
+
+static
+void
+rwleave_read(void)
+{
+	spinlock_acquire(&rwstats_lock);
+	rwreaders--;
+	spinlock_release(&rwstats_lock);
+}
+
+static
+void
+rwenter_write(unsigned long num)
+{
+	spinlock_acquire(&rwstats_lock);
+	if (rwreaders != 0 || rwwriters != 0) {
+		rwfail(num, "writing while someone else is inside");
+	}
+	rwwriters++;
+	spinlock_release(&rwstats_lock);
+}
+
+static
+void
+rwleave_write(void)
+{
+	spinlock_acquire(&rwstats_lock);
+	rwwriters--;
+	spinlock_release(&rwstats_lock);
+}
+
+static
+void
+rwcheck(unsigned long num)
+{
+	unsigned long val = testval1;
+
+	if (testval2 != val*val || testval3 != val%3) {
+		rwfail(num, "saw a half-done write");
+	}
+}
+
+static
+void
+rwwrite(unsigned long num)
+{
+	testval1 = num;
+	thread_yield();
+	testval2 = num*num;
+	testval3 = num%3;
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	int i;
+
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		switch (num % 4) {
+		    case 0:
+			rwlock_acquire_write(testrw);
+			rwenter_write(num);
+			rwwrite(num);
+			rwleave_write();
+			rwlock_release_write(testrw);
+			break;
+		    case 1:
+			rwlock_acquire_read(testrw);
+			rwenter_read(num);
+			rwcheck(num);
+			rwleave_read();
+			if (!rwlock_upgrade(testrw)) {
+				rwlock_release_read(testrw);
+				break;
+			}
+			rwenter_write(num);
+			rwwrite(num);
+			rwleave_write();
+			rwlock_downgrade(testrw);
+			rwenter_read(num);
+			/* No writer can have got in since. */
+			if (testval1 != num) {
+				rwfail(num, "lost a write across downgrade");
+			}
+			rwcheck(num);
+			rwleave_read();
+			rwlock_release_read(testrw);
+			spinlock_acquire(&rwstats_lock);
+			rwupgrades++;
+			spinlock_release(&rwstats_lock);
+			break;
+		    default:
+			rwlock_acquire_read(testrw);
+			rwenter_read(num);
+			rwcheck(num);
+			thread_yield();
+			rwcheck(num);
+			rwleave_read();
+			rwlock_release_read(testrw);
+			break;
+		}
+	}
+	V(rwdonesem);
+}
+
+static
+void
+rwtestpolicy(const char *name, unsigned policy)
+{
+	int i, result;
+
+	testrw = rwlock_create("testrw", policy);
+	if (testrw == NULL) {
+		panic("rwtest: rwlock_create failed\n");
+	}
+	testval1 = 0;
+	testval2 = 0;
+	testval3 = 0;
+	rwmaxreaders = 0;
+	rwupgrades = 0;
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("synchtest", NULL, rwtestthread,
+				     NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(rwdonesem);
+	}
+
+	KASSERT(!rwlock_held(testrw));
+	rwlock_destroy(testrw);
+	testrw = NULL;
+
+	kprintf("%s: at most %u readers at once, %u upgrades\n",
+		name, rwmaxreaders, rwupgrades);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting rwlock test...\n");
+
+	rwdonesem = sem_create("rwdonesem", 0);
+	if (rwdonesem == NULL) {
+		panic("rwtest: sem_create failed\n");
+	}
+	rwfailed = false;
+
+	rwtestpolicy("writer preference", RWLOCK_WRITERS);
+	rwtestpolicy("fair", RWLOCK_FAIR);
+
+	sem_destroy(rwdonesem);
+
+	if (rwfailed) {
+		kprintf("Test failed\n");
+	}
+	kprintf("Rwlock test done.\n");
+
+	return 0;
+}
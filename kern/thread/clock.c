@@ -28,12 +28,15 @@
  */
 
 #include <types.h>
+#include <kern/time.h>
 #include <lib.h>
 #include <cpu.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <mainbus.h>
+#include <timer.h>
 
 /*
  * Time handling.
@@ -50,14 +53,21 @@
  * Timing constants. These should be tuned along with any work done on
  * the scheduler.
  */
-#define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
+#define SCHEDULE_HARDCLOCKS	HZ	/* Boost priorities once a second. */
 #define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+#define IDLE_HARDCLOCKS		HZ	/* Longest an idle cpu sleeps. */
 
 /*
  * Once a second, everything waiting on lbolt is awakened by CPU 0.
  */
 static struct wchan *lbolt;
 
+/*
+ * Threads in thread_sleep_until wait here. Nothing ever wakes the
+ * channel; each sleeper's own timeout does.
+ */
+static struct wchan *sleepchan;
+
 /*
  * Setup.
  */
@@ -68,6 +78,10 @@ hardclock_bootstrap(void)
 	if (lbolt == NULL) {
 		panic("Couldn't create lbolt\n");
 	}
+	sleepchan = wchan_create("sleep");
+	if (sleepchan == NULL) {
+		panic("Couldn't create sleepchan\n");
+	}
 }
 
 /*
@@ -81,25 +95,99 @@ timerclock(void)
 	wchan_wakeall(lbolt);
 }
 
+/*
+ * Advance this cpu's hardclock count by TICKS, and do the periodic
+ * scheduler work for every boundary passed on the way. hardclock and
+ * hardclock_idle_exit both come through here, so that a cpu that was
+ * idle across a boundary still catches up on it. Neither holds the
+ * runqueue lock.
+ */
+static
+void
+hardclock_advance(unsigned ticks)
+{
+	unsigned old = curcpu->c_hardclocks;
+
+	curcpu->c_hardclocks += ticks;
+	if (old / SCHEDULE_HARDCLOCKS !=
+	    curcpu->c_hardclocks / SCHEDULE_HARDCLOCKS) {
+		schedule();
+	}
+	if (old / MIGRATE_HARDCLOCKS !=
+	    curcpu->c_hardclocks / MIGRATE_HARDCLOCKS) {
+		thread_consider_migration();
+	}
+}
+
 /*
  * This is called HZ times a second (on each processor) by the timer
- * code.
+ * code, except while the processor is idle; see hardclock_idle_enter.
  */
 void
 hardclock(void)
 {
+	unsigned ticks = 1;
+
 	/*
-	 * Collect statistics here as desired.
+	 * If the timer was deferred, this interrupt stands for all
+	 * the ticks that were skipped.
 	 */
+	if (curcpu->c_tickless > 0) {
+		ticks = curcpu->c_tickless;
+		curcpu->c_tickless = 0;
+		curcpu->c_idleticks += ticks - 1;
+	}
 
-	curcpu->c_hardclocks++;
-	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
-		schedule();
+	hardclock_advance(ticks);
+	timer_hardclock();
+	thread_tick();
+}
+
+/*
+ * Tickless idle. An idle cpu has nothing for hardclock to do, so
+ * rather than taking an interrupt every tick just to go back to
+ * sleep, the idle loop calls hardclock_idle_enter before waiting,
+ * which sets the timer for the next time something is due, and
+ * hardclock_idle_exit once it wakes up, which puts the ticks back.
+ * If the timer goes off first, hardclock accounts for the ticks
+ * that were skipped.
+ *
+ * Call both with interrupts off.
+ */
+void
+hardclock_idle_enter(void)
+{
+	unsigned ticks;
+
+	KASSERT(curcpu->c_isidle);
+	KASSERT(curcpu->c_tickless == 0);
+
+	/*
+	 * Sleep until the next timer is due, but wake up now and then
+	 * anyway so the idle loop can look for work to steal.
+	 */
+	ticks = timer_nextdelay(IDLE_HARDCLOCKS);
+	if (ticks <= 1) {
+		return;
 	}
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
-		thread_consider_migration();
+
+	mainbus_timer_defer(ticks);
+	curcpu->c_tickless = ticks;
+}
+
+void
+hardclock_idle_exit(void)
+{
+	unsigned ticks;
+
+	if (curcpu->c_tickless == 0) {
+		/* The timer went off; hardclock has caught up already. */
+		return;
 	}
-	thread_yield();
+	ticks = mainbus_timer_resume();
+	curcpu->c_tickless = 0;
+	curcpu->c_idleticks += ticks;
+	hardclock_advance(ticks);
 }
 
 /*
@@ -114,3 +202,52 @@ clocksleep(int num_secs)
 		num_secs--;
 	}
 }
+
+/*
+ * Return the number of hardclocks from now until WHEN, rounded up, or
+ * 0 if WHEN has passed.
+ */
+unsigned
+hardclocks_until(const struct timespec *when)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	if (when->tv_sec < secs ||
+	    (when->tv_sec == secs && (uint32_t)when->tv_nsec <= nsecs)) {
+		return 0;
+	}
+
+	secs = when->tv_sec - secs;
+	if ((uint32_t)when->tv_nsec < nsecs) {
+		secs--;
+		nsecs = when->tv_nsec + 1000000000 - nsecs;
+	}
+	else {
+		nsecs = when->tv_nsec - nsecs;
+	}
+
+	if (secs >= TIMER_MAXTICKS / HZ) {
+		return TIMER_MAXTICKS;
+	}
+	return (unsigned)secs * HZ + DIVROUNDUP(nsecs, 1000000000 / HZ);
+}
+
+/*
+ * Suspend execution until the time of day reaches WHEN.
+ */
+void
+thread_sleep_until(const struct timespec *when)
+{
+	unsigned ticks;
+
+	/*
+	 * A timer can go off up to a tick early, since the current
+	 * tick is already partly over, so check again on waking.
+	 */
+	while ((ticks = hardclocks_until(when)) > 0) {
+		wchan_lock(sleepchan);
+		wchan_sleep_timeout(sleepchan, ticks);
+	}
+}
@@ -39,8 +39,40 @@
 
 /*
  * Spinlocks.
+ *
+ * See spinlock.h for how the queue works. Each cpu has a small pool
+ * of queue nodes in its struct cpu, one for each spinlock it's
+ * holding or waiting for; since interrupts are off from before a
+ * node is taken until after it's given back, only that cpu touches
+ * the pool. Before curcpu is set up only the boot cpu is running, and
+ * it uses a pool of its own.
  */
 
+static struct spinnode spinlock_bootnodes[SPINLOCK_NODES];
+
+/* The lock word holds a node pointer; these convert. */
+#define NODE_TO_DATA(n)  ((spinlock_data_t)(vaddr_t)(n))
+#define DATA_TO_NODE(d)  ((struct spinnode *)(vaddr_t)(d))
+
+/*
+ * Take a free node from this cpu's pool. Call with interrupts off.
+ */
+static
+struct spinnode *
+spinnode_get(void)
+{
+	struct spinnode *pool;
+	unsigned i;
+
+	pool = CURCPU_EXISTS() ? curcpu->c_spinnodes : spinlock_bootnodes;
+	for (i=0; i<SPINLOCK_NODES; i++) {
+		if (!pool[i].sn_inuse) {
+			pool[i].sn_inuse = true;
+			return &pool[i];
+		}
+	}
+	panic("Too many spinlocks held on this cpu\n");
+}
 
 /*
  * Initialize spinlock.
@@ -48,7 +80,10 @@
 void
 spinlock_init(struct spinlock *lk)
 {
+	COMPILE_ASSERT(sizeof(struct spinnode *) <= sizeof(spinlock_data_t));
+
 	spinlock_data_set(&lk->lk_lock, 0);
+	lk->lk_node = NULL;
 	lk->lk_holder = NULL;
 }
 
@@ -59,6 +94,7 @@ void
 spinlock_cleanup(struct spinlock *lk)
 {
 	KASSERT(lk->lk_holder == NULL);
+	KASSERT(lk->lk_node == NULL);
 	KASSERT(spinlock_data_get(&lk->lk_lock) == 0);
 }
 
@@ -66,13 +102,16 @@ spinlock_cleanup(struct spinlock *lk)
  * Get the lock.
  *
  * First disable interrupts (otherwise, if we get a timer interrupt we
- * might come back to this lock and deadlock), then use a machine-level
- * atomic operation to wait for the lock to be free.
+ * might come back to this lock and deadlock), then get in line: swap
+ * our node in as the new tail of the queue. If there was a tail
+ * already, link ourselves behind it and wait for it to hand the lock
+ * on by clearing our sn_wait.
  */
 void
 spinlock_acquire(struct spinlock *lk)
 {
 	struct cpu *mycpu;
+	struct spinnode *node, *prev;
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -87,42 +126,58 @@ spinlock_acquire(struct spinlock *lk)
 		mycpu = NULL;
 	}
 
-	while (1) {
-		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
-		 */
-		if (spinlock_data_get(&lk->lk_lock) != 0) {
-			continue;
-		}
-		if (spinlock_data_testandset(&lk->lk_lock) != 0) {
-			continue;
+	node = spinnode_get();
+	node->sn_next = NULL;
+	node->sn_wait = true;
+
+	prev = DATA_TO_NODE(spinlock_data_swap(&lk->lk_lock,
+					       NODE_TO_DATA(node)));
+	if (prev != NULL) {
+		prev->sn_next = node;
+		while (node->sn_wait) {
+			/* spin */
 		}
-		break;
 	}
 
+	lk->lk_node = node;
 	lk->lk_holder = mycpu;
 }
 
 /*
  * Release the lock.
+ *
+ * If nobody is behind us, swing the tail back to 0. If that fails
+ * someone has just swapped themselves in and is about to link up
+ * behind us; wait for the link, then hand them the lock.
  */
 void
 spinlock_release(struct spinlock *lk)
 {
+	struct spinnode *node;
+
 	/* this must work before curcpu initialization */
 	if (CURCPU_EXISTS()) {
 		KASSERT(lk->lk_holder == curcpu->c_self);
 	}
 
+	node = lk->lk_node;
+	KASSERT(node != NULL);
 	lk->lk_holder = NULL;
-	spinlock_data_set(&lk->lk_lock, 0);
+	lk->lk_node = NULL;
+
+	if (node->sn_next == NULL &&
+	    spinlock_data_cas(&lk->lk_lock, NODE_TO_DATA(node), 0)
+	    == NODE_TO_DATA(node)) {
+		/* nobody waiting */
+	}
+	else {
+		while (node->sn_next == NULL) {
+			/* spin */
+		}
+		node->sn_next->sn_wait = false;
+	}
+
+	node->sn_inuse = false;
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
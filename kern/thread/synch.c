@@ -33,12 +33,36 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
+#include <cpu.h>
 #include <current.h>
 #include <synch.h>
+#include <clock.h>
+#include <objcache.h>
+
+static struct objcache *lock_cache;
+static struct objcache *cv_cache;
+
+static int lock_ctor(void *obj);
+static void lock_dtor(void *obj);
+static int cv_ctor(void *obj);
+static void cv_dtor(void *obj);
+
+void
+synch_bootstrap(void)
+{
+	lock_cache = objcache_create("lock", sizeof(struct lock),
+				     lock_ctor, lock_dtor);
+	cv_cache = objcache_create("cv", sizeof(struct cv),
+				   cv_ctor, cv_dtor);
+	if (lock_cache == NULL || cv_cache == NULL) {
+		panic("synch_bootstrap: Out of memory\n");
+	}
+}
 
 ////////////////////////////////////////////////////////////
 //
@@ -147,33 +171,56 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * Locks in lock_cache keep their wait channel and spinlock between
+ * uses; only the name is allocated each time.
+ */
+static
+int
+lock_ctor(void *obj)
+{
+	struct lock *lock = obj;
+
+	lock->lk_wchan = wchan_create("lock");
+	if (lock->lk_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&lock->lk_lock);
+	lock->lk_name = NULL;
+	lock->lockedBy = NULL;
+	lock->lk_waiters = 0;
+	lock->lk_handoff = false;
+	lock->lk_wanthandoff = false;
+	return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+	struct lock *lock = obj;
+
+	spinlock_cleanup(&lock->lk_lock);
+	wchan_destroy(lock->lk_wchan);
+}
+
 struct lock *
 lock_create(const char *name)
 {
         struct lock *lock;
 
-        lock = kmalloc(sizeof(struct lock));
+        lock = objcache_alloc(lock_cache);
         if (lock == NULL) {
                 return NULL;
         }
 
         lock->lk_name = kstrdup(name);
         if (lock->lk_name == NULL) {
-                kfree(lock);
+                objcache_free(lock_cache, lock);
                 return NULL;
         }
+        wchan_setname(lock->lk_wchan, lock->lk_name);
 
-        lock->lk_wchan = wchan_create(lock->lk_name);
-	if (lock->lk_wchan == NULL) {
-		kfree(lock->lk_name);
-		kfree(lock);
-		return NULL;
-	}
-        
-        spinlock_init(&lock->lk_lock);
-
-        lock->lockedBy = NULL;
-        
         return lock;
 }
 
@@ -181,28 +228,104 @@ void
 lock_destroy(struct lock *lock)
 {
         KASSERT(lock != NULL);
-        
-        spinlock_cleanup(&lock->lk_lock);
+        KASSERT(lock->lockedBy == NULL);
+        KASSERT(lock->lk_waiters == 0);
+        KASSERT(!lock->lk_handoff);
+        KASSERT(wchan_isempty(lock->lk_wchan));
+
+        lock->lk_wanthandoff = false;
 
-        wchan_destroy(lock->lk_wchan);
-        
+        wchan_setname(lock->lk_wchan, "lock");
         kfree(lock->lk_name);
-        kfree(lock);
+        lock->lk_name = NULL;
+        objcache_free(lock_cache, lock);
+}
+
+/*
+ * How many times to look at a held lock before going to sleep. Each
+ * look is a handful of instructions, so this is in the same range as
+ * the cost of a context switch out and back.
+ */
+#define LOCK_SPINS 500
+
+/*
+ * True if OWNER is running on some other cpu right now, so that it's
+ * worth waiting for it to let go. OWNER is read without any lock; it
+ * may already have released the lock, and even exited, in which case
+ * we read a stale thread structure (it stays mapped) and at worst spin
+ * to the limit for nothing.
+ */
+static
+bool
+lock_ownerrunning(volatile struct thread *owner)
+{
+    return (owner->t_state == S_RUN && owner->t_cpu != curcpu->c_self);
+}
+
+/*
+ * Spin, without holding anything, while OWNER holds the lock and is
+ * running elsewhere. Gives up early if this cpu wants to reschedule.
+ */
+static
+void
+lock_spin(struct lock *lock, volatile struct thread *owner)
+{
+    unsigned i;
+
+    for (i = 0; i < LOCK_SPINS; i++) {
+        if (lock->lockedBy != owner || !lock_ownerrunning(owner)) {
+            break;
+        }
+        if (curcpu->c_needresched) {
+            break;
+        }
+    }
 }
 
 void lock_acquire(struct lock *lock)
 {
+    volatile struct thread *owner;
+    bool spun = false, woken = false;
+
     KASSERT(lock != NULL);
     KASSERT(curthread->t_in_interrupt == false);
 
     spinlock_acquire(&lock->lk_lock);
 
-    while(lock->lockedBy != NULL)
+    while (1)
     {
+        if (lock->lk_handoff) {
+            /* Reserved for whoever the last release woke up. */
+            if (woken) {
+                lock->lk_handoff = false;
+                break;
+            }
+        }
+        else if (lock->lockedBy == NULL) {
+            break;
+        }
+
+        /* Once per wakeup, wait for a running owner without sleeping. */
+        owner = lock->lockedBy;
+        if (!spun && !lock->lk_handoff && owner != NULL &&
+            lock_ownerrunning(owner)) {
+            spun = true;
+            spinlock_release(&lock->lk_lock);
+            lock_spin(lock, owner);
+            spinlock_acquire(&lock->lk_lock);
+            continue;
+        }
+
+        if (woken) {
+            lock->lk_wanthandoff = true;
+        }
+        lock->lk_waiters++;
         wchan_lock(lock->lk_wchan);
         spinlock_release(&lock->lk_lock);
         wchan_sleep(lock->lk_wchan);
 
+        woken = true;
+        spun = false;
         spinlock_acquire(&lock->lk_lock);
     }
 
@@ -211,6 +334,10 @@ void lock_acquire(struct lock *lock)
     spinlock_release(&lock->lk_lock);
 }
 
+/*
+ * The waiter count is taken down here rather than by the waiter, so a
+ * release with nobody asleep never touches the wait channel.
+ */
 void
 lock_release(struct lock *lock)
 {
@@ -219,7 +346,14 @@ lock_release(struct lock *lock)
 
     spinlock_acquire(&lock->lk_lock);
 
-    wchan_wakeone(lock->lk_wchan);
+    if (lock->lk_waiters > 0) {
+        lock->lk_waiters--;
+        if (lock->lk_wanthandoff) {
+            lock->lk_wanthandoff = false;
+            lock->lk_handoff = true;
+        }
+        wchan_wakeone(lock->lk_wchan);
+    }
 
     lock->lockedBy = NULL;
 
@@ -239,32 +373,46 @@ lock_do_i_hold(struct lock *lock)
 // CV
 
 
+static
+int
+cv_ctor(void *obj)
+{
+	struct cv *cv = obj;
+
+	cv->cv_wchan = wchan_create("cv");
+	if (cv->cv_wchan == NULL) {
+		return ENOMEM;
+	}
+	cv->cv_name = NULL;
+	return 0;
+}
+
+static
+void
+cv_dtor(void *obj)
+{
+	struct cv *cv = obj;
+
+	wchan_destroy(cv->cv_wchan);
+}
+
 struct cv *
 cv_create(const char *name)
 {
         struct cv *cv;
 
-        cv = kmalloc(sizeof(struct cv));
+        cv = objcache_alloc(cv_cache);
         if (cv == NULL) {
                 return NULL;
         }
 
         cv->cv_name = kstrdup(name);
         if (cv->cv_name==NULL) {
-                kfree(cv);
+                objcache_free(cv_cache, cv);
                 return NULL;
         }
+        wchan_setname(cv->cv_wchan, cv->cv_name);
 
-        cv->cv_wchan = wchan_create(cv->cv_name);
-        {
-            if (cv->cv_wchan == NULL) 
-            {
-		kfree(cv->cv_name);
-		kfree(cv);
-		return NULL;
-            }
-        }
-        
         return cv;
 }
 
@@ -272,13 +420,12 @@ void
 cv_destroy(struct cv *cv)
 {
         KASSERT(cv != NULL);
+        KASSERT(wchan_isempty(cv->cv_wchan));
 
-        wchan_destroy(cv->cv_wchan);
-
-        // add stuff here as needed
-        
+        wchan_setname(cv->cv_wchan, "cv");
         kfree(cv->cv_name);
-        kfree(cv);
+        cv->cv_name = NULL;
+        objcache_free(cv_cache, cv);
 }
 
 void
@@ -298,6 +445,34 @@ cv_wait(struct cv *cv, struct lock *lock)
     lock_acquire(lock);
 }
 
+int
+cv_timedwait(struct cv *cv, struct lock *lock, const struct timespec *abstime)
+{
+    unsigned ticks;
+    int result;
+
+    KASSERT(cv != NULL);
+    KASSERT(lock != NULL);
+    KASSERT(abstime != NULL);
+
+    KASSERT(curthread->t_in_interrupt == false);
+
+    ticks = hardclocks_until(abstime);
+    if (ticks == 0) {
+        return ETIMEDOUT;
+    }
+
+    wchan_lock(cv->cv_wchan);
+
+    lock_release(lock);
+
+    result = wchan_sleep_timeout(cv->cv_wchan, ticks);
+
+    lock_acquire(lock);
+
+    return result;
+}
+
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
@@ -319,3 +494,244 @@ cv_broadcast(struct cv *cv, struct lock *lock)
     wchan_wakeall(cv->cv_wchan);
 
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+//
+// Readers are only ever woken to be let in: whoever wakes them adds
+// them all to rw_readers and bumps rw_rgen, and a sleeping reader
+// knows it's in when rw_rgen changes. Writers are woken one at a time
+// and look again, since another writer may have got there first.
+
+struct rwlock *
+rwlock_create(const char *name, unsigned policy)
+{
+	struct rwlock *rw;
+
+	KASSERT(policy == RWLOCK_WRITERS || policy == RWLOCK_FAIR);
+
+	rw = kmalloc(sizeof(*rw));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rw_name = kstrdup(name);
+	if (rw->rw_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_rwchan = wchan_create(rw->rw_name);
+	if (rw->rw_rwchan == NULL) {
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+	rw->rw_wwchan = wchan_create(rw->rw_name);
+	if (rw->rw_wwchan == NULL) {
+		wchan_destroy(rw->rw_rwchan);
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_policy = policy;
+	spinlock_init(&rw->rw_lock);
+	rw->rw_writer = NULL;
+	rw->rw_readers = 0;
+	rw->rw_rwaiting = 0;
+	rw->rw_wwaiting = 0;
+	rw->rw_rgen = 0;
+	rw->rw_upgrading = false;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rw->rw_writer == NULL);
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_rwaiting == 0);
+	KASSERT(rw->rw_wwaiting == 0);
+
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_wwchan);
+	wchan_destroy(rw->rw_rwchan);
+	kfree(rw->rw_name);
+	kfree(rw);
+}
+
+/*
+ * Let in every reader that's asleep. Call with rw_lock held.
+ */
+static
+void
+rwlock_admitreaders(struct rwlock *rw)
+{
+	if (rw->rw_rwaiting == 0) {
+		return;
+	}
+	rw->rw_readers += rw->rw_rwaiting;
+	rw->rw_rwaiting = 0;
+	rw->rw_rgen++;
+	wchan_wakeall(rw->rw_rwchan);
+}
+
+/*
+ * Sleep on the writers' channel. Call with rw_lock held; it's held
+ * again on return.
+ */
+static
+void
+rwlock_wwait(struct rwlock *rw)
+{
+	wchan_lock(rw->rw_wwchan);
+	spinlock_release(&rw->rw_lock);
+	wchan_sleep(rw->rw_wwchan);
+	spinlock_acquire(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	unsigned gen;
+
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rw->rw_writer != curthread);
+
+	spinlock_acquire(&rw->rw_lock);
+	if (rw->rw_writer == NULL && rw->rw_wwaiting == 0 &&
+	    !rw->rw_upgrading) {
+		rw->rw_readers++;
+		spinlock_release(&rw->rw_lock);
+		return;
+	}
+
+	gen = rw->rw_rgen;
+	rw->rw_rwaiting++;
+	while (rw->rw_rgen == gen) {
+		wchan_lock(rw->rw_rwchan);
+		spinlock_release(&rw->rw_lock);
+		wchan_sleep(rw->rw_rwchan);
+		spinlock_acquire(&rw->rw_lock);
+	}
+	/* rwlock_admitreaders counted us in rw_readers. */
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	KASSERT(rw->rw_writer == NULL);
+	rw->rw_readers--;
+	if (rw->rw_readers == 0) {
+		if (rw->rw_upgrading) {
+			/* Make sure the upgrader is among those woken. */
+			wchan_wakeall(rw->rw_wwchan);
+		}
+		else if (rw->rw_wwaiting > 0) {
+			wchan_wakeone(rw->rw_wwchan);
+		}
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rw->rw_writer != curthread);
+
+	spinlock_acquire(&rw->rw_lock);
+	while (rw->rw_writer != NULL || rw->rw_readers > 0 ||
+	       rw->rw_upgrading) {
+		rw->rw_wwaiting++;
+		rwlock_wwait(rw);
+		rw->rw_wwaiting--;
+	}
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rwlock_do_i_hold_write(rw));
+
+	spinlock_acquire(&rw->rw_lock);
+	rw->rw_writer = NULL;
+	if (rw->rw_policy == RWLOCK_FAIR && rw->rw_rwaiting > 0) {
+		rwlock_admitreaders(rw);
+	}
+	else if (rw->rw_wwaiting > 0) {
+		wchan_wakeone(rw->rw_wwchan);
+	}
+	else {
+		rwlock_admitreaders(rw);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_upgrade(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	if (rw->rw_upgrading) {
+		spinlock_release(&rw->rw_lock);
+		return false;
+	}
+	rw->rw_upgrading = true;
+	rw->rw_readers--;
+	while (rw->rw_readers > 0) {
+		rwlock_wwait(rw);
+	}
+	rw->rw_upgrading = false;
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+	return true;
+}
+
+void
+rwlock_downgrade(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rwlock_do_i_hold_write(rw));
+
+	spinlock_acquire(&rw->rw_lock);
+	rw->rw_writer = NULL;
+	rw->rw_readers++;
+	if (rw->rw_policy == RWLOCK_FAIR || rw->rw_wwaiting == 0) {
+		rwlock_admitreaders(rw);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	return (rw->rw_writer == curthread);
+}
+
+bool
+rwlock_held(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	return (rw->rw_writer != NULL || rw->rw_readers > 0);
+}
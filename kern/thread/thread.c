@@ -35,12 +35,15 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <lib.h>
 #include <array.h>
 #include <cpu.h>
 #include <spl.h>
 #include <spinlock.h>
 #include <wchan.h>
+#include <clock.h>
 #include <thread.h>
 #include <threadlist.h>
 #include <threadprivate.h>
@@ -50,6 +53,10 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <objcache.h>
+#include <shrinker.h>
+#include <timer.h>
+#include <workqueue.h>
 
 #include "opt-synchprobs.h"
 
@@ -64,6 +71,72 @@ struct wchan {
 	struct spinlock wc_lock;	/* lock for mutual exclusion */
 };
 
+/*
+ * Length of the scheduling quantum, in hardclocks, at each priority
+ * level. Lower levels hold CPU-bound threads, which get longer turns
+ * less often.
+ */
+static const unsigned sched_quantum[SCHED_NLEVELS] = { 2, 4, 8, 16 };
+
+/*
+ * Real-time threads may use this many hardclocks out of each second
+ * (the interval between calls to schedule()). After that they are
+ * throttled: they only run when no time-sharing thread can, until
+ * schedule() resets the count.
+ */
+#define SCHED_RTLIMIT  (HZ - HZ / 20)
+
+/* The run queue a thread belongs on. */
+#define THREAD_QUEUE(t) \
+	((t)->t_policy == SCHED_FIFO ? SCHED_RTQUEUE : \
+	 SCHED_TSQUEUE((t)->t_priority))
+
+/*
+ * A thread that ran on (or was moved to) a cpu within this many of
+ * its hardclocks is considered cache-hot there and isn't migrated.
+ */
+#define SCHED_CACHEHOT  8
+
+/* True if thread T's affinity mask allows it to run on cpu C. */
+#define THREAD_ALLOWED(t, c) \
+	((c)->c_number >= 32 || ((t)->t_affinity & (1U << (c)->c_number)))
+
+/*
+ * Fair share between processes. Each process has a weight, from its
+ * nice value, and a virtual runtime: the hardclocks its time-sharing
+ * threads have used, each counted as SCHED_VTICK / weight. Within a
+ * time-sharing level the thread whose process is furthest behind
+ * runs first, so processes get cpu in proportion to their weights
+ * however many threads they have. Each nice step is worth about 10%
+ * of the cpu.
+ */
+#define SCHED_VTICK  (1U << 20)
+
+static const unsigned sched_weights[PRIO_MAX - PRIO_MIN + 1] = {
+	/* -20 */ 88761, 71755, 56483, 46273, 36291,
+	/* -15 */ 29154, 23254, 18705, 14949, 11916,
+	/* -10 */  9548,  7620,  6100,  4904,  3906,
+	/*  -5 */  3121,  2501,  1991,  1586,  1277,
+	/*   0 */  1024,   820,   655,   526,   423,
+	/*   5 */   335,   272,   215,   172,   137,
+	/*  10 */   110,    87,    70,    56,    45,
+	/*  15 */    36,    29,    23,    18,    15,
+	/*  20 */    12,
+};
+
+/* Wraparound-safe ordering of virtual runtimes. */
+#define VRUNTIME_BEFORE(a, b)  ((int)((a) - (b)) < 0)
+
+/*
+ * How far behind a cpu's virtual clock (c_vclock) a process that has
+ * been asleep may start out: one bottom-level quantum at nice 0.
+ */
+#define SCHED_VSLACK \
+	(sched_quantum[SCHED_NLEVELS - 1] * (SCHED_VTICK / sched_weights[-PRIO_MIN]))
+
+static bool thread_steal(void);
+static void thread_idle(void *unused1, unsigned long unused2);
+
 /* Master array of CPUs. */
 DECLARRAY(cpu);
 DEFARRAY(cpu, /*no inline*/ );
@@ -111,49 +184,235 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+static struct objcache *thread_cache;
+
 /*
- * Create a thread. This is used both to create a first thread
- * for each CPU and to create subsequent forked threads.
+ * Object cache constructor and destructor. These set up the parts of
+ * struct thread that thread_destroy leaves in their initial state.
  */
 static
-struct thread *
-thread_create(const char *name)
+int
+thread_ctor(void *obj)
 {
-	struct thread *thread;
+	struct thread *thread = obj;
+
+	thread_machdep_init(&thread->t_machdep);
+	threadlistnode_init(&thread->t_listnode, thread);
+	return 0;
+}
 
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_cleanup(&thread->t_listnode);
+	thread_machdep_cleanup(&thread->t_machdep);
+}
+
+/*
+ * Set up a new thread's fields, except for t_stack, which is left
+ * alone so that recycled shells keep theirs.
+ */
+static
+int
+thread_init(struct thread *thread, const char *name)
+{
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
-	if (thread == NULL) {
-		return NULL;
+	if (strlen(name) < sizeof(thread->t_namebuf)) {
+		strcpy(thread->t_namebuf, name);
+		thread->t_name = thread->t_namebuf;
 	}
-
-	thread->t_name = kstrdup(name);
-	if (thread->t_name == NULL) {
-		kfree(thread);
-		return NULL;
+	else {
+		thread->t_name = kstrdup(name);
+		if (thread->t_name == NULL) {
+			return ENOMEM;
+		}
 	}
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
 
 	/* Thread subsystem fields */
-	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
+	thread->t_wchan = NULL;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
+	thread->t_nopreempt = 0;
+
+	/* Scheduler fields; new threads start at the top level */
+	thread->t_policy = SCHED_OTHER;
+	thread->t_priority = 0;
+	thread->t_ticksleft = sched_quantum[0];
+	thread->t_lastran = 0;
+	thread->t_affinity = THREAD_AFFINITY_ALL;
+	thread->t_readysince = 0;
+	thread->t_runsince = 0;
+
+	thread->t_inshrink = false;
 
 	/* If you add to struct thread, be sure to initialize here */
 
+	return 0;
+}
+
+/*
+ * Create a thread. This is used both to create a first thread
+ * for each CPU and to create subsequent forked threads.
+ */
+static
+struct thread *
+thread_create(const char *name)
+{
+	struct thread *thread;
+
+	thread = objcache_alloc(thread_cache);
+	if (thread == NULL) {
+		return NULL;
+	}
+	thread->t_stack = NULL;
+	if (thread_init(thread, name)) {
+		objcache_free(thread_cache, thread);
+		return NULL;
+	}
+	return thread;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Thread shells.
+ *
+ * When a thread with its own stack is destroyed, the struct thread
+ * and the stack are kept together on the current cpu's c_shells
+ * list, up to THREAD_MAXSHELLS of them, and thread_fork takes them
+ * from there before going to the allocator. A shell's stack still
+ * has its guard words, which thread_destroy has just checked, so
+ * they don't need to be written again.
+ *
+ * Under memory pressure the thread shrinker frees the shells.
+ */
+
+#define THREAD_MAXSHELLS  8
+
+/*
+ * Free a thread shell for good.
+ */
+static
+void
+thread_shell_free(struct thread *thread)
+{
+	kfree(thread->t_stack);
+	thread->t_stack = NULL;
+	objcache_free(thread_cache, thread);
+}
+
+/*
+ * Keep a destroyed thread for reuse. Returns false if this cpu has
+ * enough already.
+ */
+static
+bool
+thread_shell_put(struct thread *thread)
+{
+	struct cpu *c;
+	bool kept = false;
+	int spl;
+
+	KASSERT(thread->t_stack != NULL);
+
+	/* Stay on this cpu while choosing its list. */
+	spl = splhigh();
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_shells_lock);
+	if (c->c_shells.tl_count < THREAD_MAXSHELLS) {
+		threadlist_addhead(&c->c_shells, thread);
+		kept = true;
+	}
+	spinlock_release(&c->c_shells_lock);
+	splx(spl);
+
+	return kept;
+}
+
+/*
+ * Take a thread shell, stack included, from this cpu's cache.
+ * Returns NULL if there are none.
+ */
+static
+struct thread *
+thread_shell_get(void)
+{
+	struct cpu *c;
+	struct thread *thread;
+	int spl;
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_shells_lock);
+	thread = threadlist_remhead(&c->c_shells);
+	spinlock_release(&c->c_shells_lock);
+	splx(spl);
+
 	return thread;
 }
 
+static
+unsigned
+thread_shrink_count(void *data)
+{
+	struct cpu *c;
+	unsigned i, count = 0;
+
+	(void)data;
+
+	/* Each shell's stack is a page; the thread itself is extra. */
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		count += c->c_shells.tl_count;
+	}
+	return count;
+}
+
+static
+unsigned
+thread_shrink_scan(void *data, unsigned npages)
+{
+	struct cpu *c;
+	struct thread *thread;
+	unsigned i, freed = 0;
+
+	(void)data;
+
+	for (i=0; i<cpuarray_num(&allcpus) && freed < npages; i++) {
+		c = cpuarray_get(&allcpus, i);
+		while (freed < npages) {
+			spinlock_acquire(&c->c_shells_lock);
+			thread = threadlist_remhead(&c->c_shells);
+			spinlock_release(&c->c_shells_lock);
+			if (thread == NULL) {
+				break;
+			}
+			thread_shell_free(thread);
+			freed++;
+		}
+	}
+	return freed;
+}
+
+static struct shrinker thread_shrinker = {
+	.sh_name = "threads",
+	.sh_count = thread_shrink_count,
+	.sh_scan = thread_shrink_scan,
+	.sh_data = NULL,
+};
+
 /*
  * Create a CPU structure. This is used for the bootup CPU and
  * also for secondary CPUs.
@@ -167,6 +426,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -178,22 +438,69 @@ cpu_create(unsigned hardware_number)
 	c->c_hardware_number = hardware_number;
 
 	c->c_curthread = NULL;
+	c->c_idlethread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_steals = 0;
+	c->c_migrations = 0;
+	c->c_forkedout = 0;
+	c->c_tickless = 0;
+	c->c_idleticks = 0;
+	c->c_quietticks = 0;
+	c->c_rtticks = 0;
+	c->c_rtthrottled = false;
+	c->c_rtthrottles = 0;
+	c->c_timers = timerwheel_create();
+	if (c->c_timers == NULL) {
+		panic("cpu_create: Out of memory\n");
+	}
+	threadlist_init(&c->c_shells);
+	spinlock_init(&c->c_shells_lock);
+	c->c_switches = 0;
+	c->c_voluntary = 0;
+	c->c_involuntary = 0;
+	c->c_idles = 0;
+	c->c_preemptions = 0;
+	c->c_maxwait = 0;
+	c->c_idletime = 0;
+	for (i=0; i<SCHED_HISTSIZE; i++) {
+		c->c_waithist[i] = 0;
+		c->c_slicehist[i] = 0;
+	}
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	c->c_needresched = false;
+	c->c_vclock = 0;
+	for (i=0; i<SCHED_NQUEUES; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_runcount = 0;
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdowns_posted = 0;
+	c->c_shootdowns_done = 0;
 	spinlock_init(&c->c_ipi_lock);
 
+	for (i=0; i<SPINLOCK_NODES; i++) {
+		c->c_spinnodes[i].sn_next = NULL;
+		c->c_spinnodes[i].sn_wait = false;
+		c->c_spinnodes[i].sn_inuse = false;
+	}
+
+	c->c_kmcache = NULL;
+
 	result = cpuarray_add(&allcpus, c, &c->c_number);
 	if (result != 0) {
 		panic("cpu_create: array_add: %s\n", strerror(result));
 	}
 
+	c->c_workpool = workpool_create(c->c_number);
+	if (c->c_workpool == NULL) {
+		panic("cpu_create: Out of memory\n");
+	}
+
 	snprintf(namebuf, sizeof(namebuf), "<boot #%d>", c->c_number);
 	c->c_curthread = thread_create(namebuf);
 	if (c->c_curthread == NULL) {
@@ -222,6 +529,26 @@ cpu_create(unsigned hardware_number)
 	}
 	c->c_curthread->t_cpu = c;
 
+	/*
+	 * Create the idle thread. It isn't part of any process and
+	 * never goes on a run queue; thread_switch runs it when there
+	 * is nothing else to do. Like a newly forked thread it starts
+	 * out holding the run queue lock.
+	 */
+	snprintf(namebuf, sizeof(namebuf), "<idle #%d>", c->c_number);
+	c->c_idlethread = thread_create(namebuf);
+	if (c->c_idlethread == NULL) {
+		panic("cpu_create: thread_create failed\n");
+	}
+	c->c_idlethread->t_stack = kmalloc(STACK_SIZE);
+	if (c->c_idlethread->t_stack == NULL) {
+		panic("cpu_create: couldn't allocate stack");
+	}
+	thread_checkstack_init(c->c_idlethread);
+	c->c_idlethread->t_cpu = c;
+	c->c_idlethread->t_iplhigh_count++;
+	switchframe_init(c->c_idlethread, thread_idle, NULL, 0);
+
 	cpu_machdep_init(c);
 
 	return c;
@@ -249,17 +576,26 @@ thread_destroy(struct thread *thread)
 
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
-	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
-	}
-	threadlistnode_cleanup(&thread->t_listnode);
-	thread_machdep_cleanup(&thread->t_machdep);
+	/* The rest is cleaned up by thread_dtor when the slab goes. */
+	KASSERT(thread->t_listnode.tln_prev == NULL);
+	KASSERT(thread->t_listnode.tln_next == NULL);
 
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
-	kfree(thread->t_name);
-	kfree(thread);
+	if (thread->t_name != NULL && thread->t_name != thread->t_namebuf) {
+		kfree(thread->t_name);
+	}
+	thread->t_name = NULL;
+
+	if (thread->t_stack != NULL) {
+		thread_checkstack(thread);
+		if (!thread_shell_put(thread)) {
+			thread_shell_free(thread);
+		}
+		return;
+	}
+	objcache_free(thread_cache, thread);
 }
 
 /*
@@ -289,6 +625,8 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -303,9 +641,12 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = NULL;
-	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	for (i=0; i<SCHED_NQUEUES; i++) {
+		curcpu->c_runqueue[i].tl_count = 0;
+		curcpu->c_runqueue[i].tl_head.tln_next = NULL;
+		curcpu->c_runqueue[i].tl_tail.tln_prev = NULL;
+	}
+	curcpu->c_runcount = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -351,6 +692,13 @@ thread_bootstrap(void)
 
 	cpuarray_init(&allcpus);
 
+	thread_cache = objcache_create("thread", sizeof(struct thread),
+				       thread_ctor, thread_dtor);
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+	shrinker_register(&thread_shrinker);
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -427,87 +775,468 @@ thread_start_cpus(void)
 }
 
 /*
- * Make a thread runnable.
+ * Keep the virtual runtime of T's process near C's virtual clock as
+ * T is queued there. A process that has been asleep, or has been
+ * running on a less busy cpu, would otherwise have a large credit or
+ * debt that shuts everything else here out, or shuts it out, until
+ * paid off. Behind by up to SCHED_VSLACK is a reasonable wakeup
+ * boost; ahead by up to one bottom-level quantum of its own is what
+ * it can fairly have run ahead.
  *
- * targetcpu might be curcpu; it might not be, too. 
+ * Called with C's runqueue lock held, so this takes p_schedlock and
+ * not p_lock: p_lock is held across allocations, and those can end
+ * up waking a thread onto a runqueue.
  */
 static
 void
-thread_make_runnable(struct thread *target, bool already_have_lock)
+runqueue_clampvruntime(struct cpu *c, struct thread *t)
 {
-	struct cpu *targetcpu;
-	bool isidle;
-
-	/* Lock the run queue of the target thread's cpu. */
-	targetcpu = target->t_cpu;
+	struct proc *p = t->t_proc;
+	unsigned lo, hi;
 
-	if (already_have_lock) {
-		/* The target thread's cpu should be already locked. */
-		KASSERT(spinlock_do_i_hold(&targetcpu->c_runqueue_lock));
+	if (p == NULL || t->t_policy != SCHED_OTHER) {
+		return;
 	}
-	else {
-		spinlock_acquire(&targetcpu->c_runqueue_lock);
+	spinlock_acquire(&p->p_schedlock);
+	lo = c->c_vclock - SCHED_VSLACK;
+	hi = c->c_vclock +
+		sched_quantum[SCHED_NLEVELS - 1] * (SCHED_VTICK / p->p_weight);
+	if (VRUNTIME_BEFORE(p->p_vruntime, lo)) {
+		p->p_vruntime = lo;
 	}
-
-	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
-	if (isidle) {
-		/*
-		 * Other processor is idle; send interrupt to make
-		 * sure it unidles.
-		 */
-		ipi_send(targetcpu, IPI_UNIDLE);
+	else if (VRUNTIME_BEFORE(hi, p->p_vruntime)) {
+		p->p_vruntime = hi;
 	}
+	spinlock_release(&p->p_schedlock);
+}
 
-	if (!already_have_lock) {
-		spinlock_release(&targetcpu->c_runqueue_lock);
+/*
+ * True if T should run before BEST, both being on the same
+ * time-sharing queue. Threads that have left their process are on
+ * their way out and go first.
+ */
+static
+bool
+runqueue_fairbefore(struct thread *t, struct thread *best)
+{
+	if (best->t_proc == NULL) {
+		return false;
 	}
+	if (t->t_proc == NULL) {
+		return true;
+	}
+	return VRUNTIME_BEFORE(t->t_proc->p_vruntime,
+			       best->t_proc->p_vruntime);
 }
 
 /*
- * Create a new thread based on an existing one.
- *
- * The new thread has name NAME, and starts executing in function
- * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
- *
- * The new thread is created in the process P. If P is null, the
- * process is inherited from the caller. It will start on the same CPU
- * as the caller, unless the scheduler intervenes first.
+ * Run queue operations. Each cpu has one queue per priority level;
+ * threads are taken from the highest-priority nonempty queue. Call
+ * with the cpu's run queue lock held.
  */
-int
-thread_fork(const char *name,
-	    struct proc *proc,
-	    void (*entrypoint)(void *data1, unsigned long data2),
-	    void *data1, unsigned long data2)
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
 {
-	struct thread *newthread;
-	int result;
-
-#ifdef UW
-	DEBUG(DB_THREADS,"Forking thread: %s\n",name);
-#endif // UW
+	KASSERT(t->t_priority < SCHED_NLEVELS);
+	runqueue_clampvruntime(c, t);
+	threadlist_addtail(&c->c_runqueue[THREAD_QUEUE(t)], t);
+	c->c_runcount++;
+}
 
-	newthread = thread_create(name);
-	if (newthread == NULL) {
-		return ENOMEM;
-	}
+/*
+ * Take a thread off C's run queues that can be moved to cpu TO: one
+ * that TO's affinity allows and, unless HOTOK is set, that hasn't run
+ * on C recently. Prefers the thread that would run last. Returns NULL
+ * if there isn't one.
+ */
+static
+struct thread *
+runqueue_remmovable(struct cpu *c, struct cpu *to, bool hotok)
+{
+	struct thread *t;
+	unsigned i;
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+	for (i=SCHED_NQUEUES; i-- > 0; ) {
+		THREADLIST_FORALL_REV(t, c->c_runqueue[i]) {
+			if (!THREAD_ALLOWED(t, to)) {
+				continue;
+			}
+			if (!hotok &&
+			    c->c_hardclocks - t->t_lastran < SCHED_CACHEHOT) {
+				continue;
+			}
+			threadlist_remove(&c->c_runqueue[i], t);
+			c->c_runcount--;
+			return t;
+		}
 	}
-	thread_checkstack_init(newthread);
-
-	/*
-	 * Now we clone various fields from the parent thread.
-	 */
+	return NULL;
+}
 
-	/* Thread subsystem fields */
-	newthread->t_cpu = curthread->t_cpu;
+/*
+ * Take the next thread allowed to run on C from run queues FROM
+ * through TO-1. Real-time threads are first come first served; on a
+ * time-sharing queue the thread whose process has the least virtual
+ * runtime goes first, in queue order among equals, and moves C's
+ * virtual clock up to that.
+ */
+static
+struct thread *
+runqueue_remnext(struct cpu *c, unsigned from, unsigned to)
+{
+	struct thread *t, *best;
+	unsigned i;
 
-	/* Attach the new thread to its process */
+	for (i=from; i<to; i++) {
+		best = NULL;
+		THREADLIST_FORALL(t, c->c_runqueue[i]) {
+			if (!THREAD_ALLOWED(t, c)) {
+				continue;
+			}
+			if (i == SCHED_RTQUEUE) {
+				best = t;
+				break;
+			}
+			if (best == NULL || runqueue_fairbefore(t, best)) {
+				best = t;
+			}
+		}
+		if (best != NULL) {
+			threadlist_remove(&c->c_runqueue[i], best);
+			c->c_runcount--;
+			if (i != SCHED_RTQUEUE && best->t_proc != NULL &&
+			    VRUNTIME_BEFORE(c->c_vclock,
+					    best->t_proc->p_vruntime)) {
+				c->c_vclock = best->t_proc->p_vruntime;
+			}
+			return best;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take the next thread from C's run queues that is allowed to run
+ * on C. Threads whose affinity excludes C wait to be moved by
+ * thread_push_disallowed or stolen by a cpu they can run on. If
+ * real-time threads are throttled they only get what's left over.
+ */
+static
+struct thread *
+runqueue_remrunnable(struct cpu *c)
+{
+	struct thread *t;
+
+	if (!c->c_rtthrottled) {
+		return runqueue_remnext(c, 0, SCHED_NQUEUES);
+	}
+	t = runqueue_remnext(c, SCHED_RTQUEUE + 1, SCHED_NQUEUES);
+	if (t == NULL) {
+		t = runqueue_remnext(c, SCHED_RTQUEUE, SCHED_RTQUEUE + 1);
+	}
+	return t;
+}
+
+/*
+ * Check if any thread on C's run queues may run on C.
+ */
+static
+bool
+runqueue_hasrunnable(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	for (i=0; i<SCHED_NQUEUES; i++) {
+		THREADLIST_FORALL(t, c->c_runqueue[i]) {
+			if (THREAD_ALLOWED(t, c)) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+/*
+ * Choose the least loaded cpu T may run on, going by the c_runcount
+ * hints. Falls back to T's current cpu if the mask matches no cpu.
+ */
+static
+struct cpu *
+thread_pickcpu(struct thread *t)
+{
+	struct cpu *c, *best;
+	unsigned i, numcpus;
+
+	best = NULL;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (!THREAD_ALLOWED(t, c)) {
+			continue;
+		}
+		if (best == NULL || c->c_runcount < best->c_runcount) {
+			best = c;
+		}
+	}
+	return best != NULL ? best : t->t_cpu;
+}
+
+/*
+ * Choose the cpu for a thread the current thread is forking. A cpu's
+ * load is its c_runcount hint plus one if it's running something
+ * other than its idle thread, so our own cpu counts us. Ties go to
+ * our cpu, where the parent's data is still in cache, and then to
+ * the cpus after ours in order, so a burst of forks from one cpu
+ * doesn't all land on cpu 0.
+ */
+static
+struct cpu *
+thread_forkcpu(struct thread *t)
+{
+	struct cpu *c, *best;
+	unsigned i, numcpus, start, load, bestload;
+
+	best = NULL;
+	bestload = 0;
+	numcpus = cpuarray_num(&allcpus);
+	start = curcpu->c_number;
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, (start + i) % numcpus);
+		if (!THREAD_ALLOWED(t, c)) {
+			continue;
+		}
+		load = c->c_runcount + (c->c_isidle ? 0 : 1);
+		if (best == NULL || load < bestload) {
+			best = c;
+			bestload = load;
+		}
+		if (bestload == 0) {
+			/* Can't do better than an idle cpu. */
+			break;
+		}
+	}
+	return best != NULL ? best : curcpu->c_self;
+}
+
+/*
+ * Put a thread that has been taken off another cpu's run queue onto
+ * C's, and poke C if it's idle. Call without any run queue lock.
+ */
+static
+void
+thread_moveto(struct thread *t, struct cpu *c)
+{
+	spinlock_acquire(&c->c_runqueue_lock);
+	t->t_cpu = c;
+	/* Count it as freshly arrived, so it isn't moved straight on. */
+	t->t_lastran = c->c_hardclocks;
+	runqueue_add(c, t);
+	if (c->c_isidle && c != curcpu->c_self) {
+		ipi_send(c, IPI_UNIDLE);
+	}
+	spinlock_release(&c->c_runqueue_lock);
+}
+
+/*
+ * Move every thread on this cpu's run queues whose affinity mask
+ * excludes this cpu to a cpu it is allowed on.
+ */
+static
+void
+thread_push_disallowed(void)
+{
+	struct thread *t;
+	struct cpu *c;
+	unsigned i;
+	bool found;
+
+	do {
+		found = false;
+		spinlock_acquire(&curcpu->c_runqueue_lock);
+		for (i=0; i<SCHED_NQUEUES && !found; i++) {
+			THREADLIST_FORALL(t, curcpu->c_runqueue[i]) {
+				if (!THREAD_ALLOWED(t, curcpu->c_self)) {
+					threadlist_remove(&curcpu->c_runqueue[i],
+							  t);
+					curcpu->c_runcount--;
+					found = true;
+					break;
+				}
+			}
+		}
+		spinlock_release(&curcpu->c_runqueue_lock);
+
+		if (found) {
+			c = thread_pickcpu(t);
+			thread_moveto(t, c);
+			curcpu->c_migrations++;
+		}
+	} while (found);
+}
+
+/*
+ * Check if thread T, just queued on cpu C, should displace the thread
+ * C is running: it's on a higher-priority queue and, if it's
+ * real-time, real-time threads aren't throttled there. Call with C's
+ * run queue lock held. C's current thread is only read, so this is a
+ * hint if C is another cpu.
+ */
+static
+bool
+thread_preempts(struct thread *t, struct cpu *c)
+{
+	struct thread *cur = c->c_curthread;
+
+	if (cur == NULL || cur == t) {
+		return false;
+	}
+	if (t->t_policy == SCHED_FIFO && c->c_rtthrottled) {
+		return false;
+	}
+	return THREAD_QUEUE(t) < THREAD_QUEUE(cur);
+}
+
+/*
+ * Whether to time waits and slices for thread_printlatency. Reading
+ * the clock is device I/O, too slow to do on every switch by default.
+ */
+static bool sched_timing;
+
+void
+thread_settiming(bool on)
+{
+	sched_timing = on;
+}
+
+/*
+ * Make a thread runnable.
+ *
+ * targetcpu might be curcpu; it might not be, too. 
+ */
+static
+void
+thread_make_runnable(struct thread *target, bool already_have_lock)
+{
+	struct cpu *targetcpu;
+	bool isidle;
+
+	/* Start the clock on how long it waits to run. */
+	target->t_readysince = sched_timing ? clock_usec() : 0;
+
+	/* Lock the run queue of the target thread's cpu. */
+	targetcpu = target->t_cpu;
+
+	if (already_have_lock) {
+		/* The target thread's cpu should be already locked. */
+		KASSERT(spinlock_do_i_hold(&targetcpu->c_runqueue_lock));
+	}
+	else {
+		spinlock_acquire(&targetcpu->c_runqueue_lock);
+
+		/*
+		 * If the thread may no longer run on its cpu, send it
+		 * to one it may run on instead. (Holding the lock
+		 * means the thread has finished switching out.)
+		 */
+		if (!THREAD_ALLOWED(target, targetcpu)) {
+			spinlock_release(&targetcpu->c_runqueue_lock);
+			targetcpu = thread_pickcpu(target);
+			target->t_cpu = targetcpu;
+			target->t_lastran = targetcpu->c_hardclocks;
+			spinlock_acquire(&targetcpu->c_runqueue_lock);
+		}
+	}
+
+	isidle = targetcpu->c_isidle;
+	runqueue_add(targetcpu, target);
+	if (isidle) {
+		/*
+		 * Other processor is idle; send interrupt to make
+		 * sure it unidles.
+		 */
+		ipi_send(targetcpu, IPI_UNIDLE);
+	}
+	else if (thread_preempts(target, targetcpu) &&
+		 !targetcpu->c_needresched) {
+		/*
+		 * It should run before what that cpu is running now.
+		 * Ask for a reschedule, which happens at the end of
+		 * the next interrupt there; if it's another cpu, send
+		 * one.
+		 */
+		targetcpu->c_needresched = true;
+		if (targetcpu != curcpu->c_self) {
+			ipi_send(targetcpu, IPI_UNIDLE);
+		}
+	}
+
+	if (!already_have_lock) {
+		spinlock_release(&targetcpu->c_runqueue_lock);
+	}
+}
+
+/*
+ * Create a new thread based on an existing one.
+ *
+ * The new thread has name NAME, and starts executing in function
+ * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
+ *
+ * The new thread is created in the process P. If P is null, the
+ * process is inherited from the caller. It will start on the same CPU
+ * as the caller, unless the scheduler intervenes first.
+ *
+ * POLICY is the new thread's scheduling class.
+ */
+static
+int
+thread_fork_policy(const char *name,
+		   struct proc *proc,
+		   unsigned policy,
+		   void (*entrypoint)(void *data1, unsigned long data2),
+		   void *data1, unsigned long data2)
+{
+	struct thread *newthread;
+	int result;
+
+#ifdef UW
+	DEBUG(DB_THREADS,"Forking thread: %s\n",name);
+#endif // UW
+
+	/* Reuse an exited thread and its stack if we can. */
+	newthread = thread_shell_get();
+	if (newthread != NULL) {
+		result = thread_init(newthread, name);
+		if (result) {
+			thread_destroy(newthread);
+			return result;
+		}
+	}
+	else {
+		newthread = thread_create(name);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
+
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
+	}
+
+	/*
+	 * Now we clone various fields from the parent thread.
+	 */
+
+	/* Thread subsystem fields */
+	newthread->t_affinity = curthread->t_affinity;
+	newthread->t_policy = policy;
+
+	/* Attach the new thread to its process */
 	if (proc == NULL) {
 		proc = curthread->t_proc;
 	}
@@ -528,12 +1257,111 @@ thread_fork(const char *name,
 	/* Set up the switchframe so entrypoint() gets called */
 	switchframe_init(newthread, entrypoint, data1, data2);
 
-	/* Lock the current cpu's run queue and make the new thread runnable */
+	/*
+	 * Pick a cpu for it and make it runnable there; if that cpu is
+	 * idle thread_make_runnable pokes it directly. Stay put while
+	 * choosing so the load we compare against is our own cpu's.
+	 */
+	thread_preempt_disable();
+	newthread->t_cpu = thread_forkcpu(newthread);
+	if (newthread->t_cpu != curcpu->c_self) {
+		curcpu->c_forkedout++;
+	}
+	thread_preempt_enable();
 	thread_make_runnable(newthread, false);
 
 	return 0;
 }
 
+int
+thread_fork(const char *name,
+	    struct proc *proc,
+	    void (*entrypoint)(void *data1, unsigned long data2),
+	    void *data1, unsigned long data2)
+{
+	return thread_fork_policy(name, proc, SCHED_OTHER,
+				  entrypoint, data1, data2);
+}
+
+int
+thread_fork_rt(const char *name,
+	       struct proc *proc,
+	       void (*entrypoint)(void *data1, unsigned long data2),
+	       void *data1, unsigned long data2)
+{
+	return thread_fork_policy(name, proc, SCHED_FIFO,
+				  entrypoint, data1, data2);
+}
+
+/*
+ * Histogram bucket for an interval of USEC microseconds. Bucket 0
+ * is under 64us and each bucket after it covers twice the range of
+ * the one before; the last one also takes everything longer.
+ */
+static
+unsigned
+sched_histbucket(uint32_t usec)
+{
+	unsigned bucket = 0;
+
+	usec >>= 6;
+	while (usec > 0 && bucket < SCHED_HISTSIZE - 1) {
+		usec >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+/*
+ * Record a switch from CUR, which is going to NEWSTATE, to NEXT.
+ * Call with the run queue locked.
+ */
+static
+void
+thread_switchstats(struct thread *cur, struct thread *next,
+		   threadstate_t newstate)
+{
+	struct cpu *c = curcpu->c_self;
+	uint32_t now, wait;
+
+	c->c_switches++;
+	if (cur != c->c_idlethread) {
+		if (newstate == S_READY) {
+			c->c_involuntary++;
+		}
+		else {
+			c->c_voluntary++;
+		}
+	}
+	if (next == c->c_idlethread) {
+		c->c_idles++;
+	}
+
+	if (!sched_timing) {
+		next->t_runsince = 0;
+		return;
+	}
+
+	/* A stamp of 0 means timing was off when it would have been taken. */
+	now = clock_usec();
+	if (cur->t_runsince != 0) {
+		if (cur == c->c_idlethread) {
+			c->c_idletime += now - cur->t_runsince;
+		}
+		else {
+			c->c_slicehist[sched_histbucket(now - cur->t_runsince)]++;
+		}
+	}
+	if (next != c->c_idlethread && next->t_readysince != 0) {
+		wait = now - next->t_readysince;
+		c->c_waithist[sched_histbucket(wait)]++;
+		if (wait > c->c_maxwait) {
+			c->c_maxwait = wait;
+		}
+	}
+	next->t_runsince = now;
+}
+
 /*
  * High level, machine-independent context switch code.
  *
@@ -558,36 +1386,51 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 
 	cur = curthread;
 
-	/*
-	 * If we're idle, return without doing anything. This happens
-	 * when the timer interrupt interrupts the idle loop.
-	 */
-	if (curcpu->c_isidle) {
-		splx(spl);
-		return;
-	}
-
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
-	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	/* Whatever asked for a reschedule gets one now. */
+	curcpu->c_needresched = false;
+
+	/*
+	 * Micro-optimization: if nothing to do, just return. A thread
+	 * that may no longer run here goes through anyway, so that it
+	 * gets switched out and can be moved.
+	 */
+	if (newstate == S_READY && curcpu->c_runcount == 0 &&
+	    THREAD_ALLOWED(cur, curcpu->c_self)) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
 	}
 
+	/* Note when the thread last had the cpu, for migration. */
+	cur->t_lastran = curcpu->c_hardclocks;
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
 		panic("Illegal S_RUN in thread_switch\n");
 	    case S_READY:
-		thread_make_runnable(cur, true /*have lock*/);
+		/* The idle thread is never on the run queue. */
+		if (cur != curcpu->c_idlethread) {
+			thread_make_runnable(cur, true /*have lock*/);
+		}
 		break;
 	    case S_SLEEP:
+		KASSERT(cur->t_nopreempt == 0);
+		/*
+		 * Blocking before the quantum runs out marks the
+		 * thread as interactive or I/O-bound; move it up a
+		 * level so it runs promptly when it wakes.
+		 */
+		if (cur->t_policy == SCHED_OTHER && cur->t_priority > 0) {
+			cur->t_priority--;
+		}
+		cur->t_ticksleft = sched_quantum[cur->t_priority];
 		cur->t_wchan_name = wc->wc_name;
 		/*
 		 * Add the thread to the list in the wait channel, and
@@ -602,6 +1445,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		 * or want it locked and if it does can lock it itself
 		 * without racing. Exercise: what's the other?)
 		 */
+		cur->t_wchan = wc;
 		threadlist_addtail(&wc->wc_threads, cur);
 		wchan_unlock(wc);
 		break;
@@ -613,33 +1457,23 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	cur->t_state = newstate;
 
 	/*
-	 * Get the next thread. While there isn't one, call md_idle().
-	 * curcpu->c_isidle must be true when md_idle is
-	 * called. Unlock the runqueue while idling too, to make sure
-	 * things can be added to it.
+	 * Get the next thread. If there isn't one, run the idle
+	 * thread, which waits for work (see thread_idle). Switching
+	 * to it rather than idling on the current thread's stack
+	 * means every thread that isn't running has its context saved
+	 * and can be moved to another cpu.
 	 *
-	 * Note that we don't need to unlock the runqueue atomically
-	 * with idling; becoming unidle requires receiving an
-	 * interrupt (either a hardware interrupt or an interprocessor
-	 * interrupt from another cpu posting a wakeup) and idling
-	 * *is* atomic with respect to re-enabling interrupts.
-	 *
-	 * Note that c_isidle becomes true briefly even if we don't go
-	 * idle. However, because one is supposed to hold the runqueue
-	 * lock to look at it, this should not be visible or matter.
+	 * curcpu->c_isidle is true while the idle thread runs.
 	 */
+	next = runqueue_remrunnable(curcpu);
+	if (next == NULL) {
+		next = curcpu->c_idlethread;
+	}
+	curcpu->c_isidle = (next == curcpu->c_idlethread);
 
-	/* The current cpu is now idle. */
-	curcpu->c_isidle = true;
-	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
-		if (next == NULL) {
-			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
-			spinlock_acquire(&curcpu->c_runqueue_lock);
-		}
-	} while (next == NULL);
-	curcpu->c_isidle = false;
+	if (next != cur) {
+		thread_switchstats(cur, next, newstate);
+	}
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -750,89 +1584,324 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	/* Enable interrupts. */
 	spl0();
 
-#if OPT_SYNCHPROBS
-	/* Yield a random number of times to get a good mix of threads. */
-	{
-		int i, n;
-		n = random()%161 + random()%161;
-		for (i=0; i<n; i++) {
-			thread_yield();
+#if OPT_SYNCHPROBS
+	/* Yield a random number of times to get a good mix of threads. */
+	{
+		int i, n;
+		n = random()%161 + random()%161;
+		for (i=0; i<n; i++) {
+			thread_yield();
+		}
+	}
+#endif
+
+	/* Call the function. */
+	entrypoint(data1, data2);
+
+	/* Done. */
+	thread_exit();
+}
+
+/*
+ * The idle thread. Each cpu runs its idle thread when it has nothing
+ * else to do. It tries to steal work from other cpus and otherwise
+ * waits in cpu_idle() until an interrupt arrives, then switches to
+ * whatever became runnable.
+ *
+ * Idling doesn't need to unlock the run queue atomically with going
+ * idle: becoming unidle requires receiving an interrupt (either a
+ * hardware interrupt or an interprocessor interrupt from another cpu
+ * posting a wakeup) and idling *is* atomic with respect to
+ * re-enabling interrupts.
+ */
+static
+void
+thread_idle(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
+
+	splhigh();
+	while (1) {
+		/* Threads that may no longer run here are sent away. */
+		thread_push_disallowed();
+
+		spinlock_acquire(&curcpu->c_runqueue_lock);
+		while (!runqueue_hasrunnable(curcpu)) {
+			spinlock_release(&curcpu->c_runqueue_lock);
+			if (!thread_steal()) {
+				hardclock_idle_enter();
+				cpu_idle();
+				hardclock_idle_exit();
+			}
+			spinlock_acquire(&curcpu->c_runqueue_lock);
+		}
+		spinlock_release(&curcpu->c_runqueue_lock);
+
+		thread_switch(S_READY, NULL);
+	}
+}
+
+/*
+ * Cause the current thread to exit.
+ *
+ * The parts of the thread structure we don't actually need to run
+ * should be cleaned up right away. The rest has to wait until
+ * thread_destroy is called from exorcise().
+ *
+ * Does not return.
+ */
+void
+thread_exit(void)
+{
+	struct thread *cur;
+
+	cur = curthread;
+
+#ifdef UW
+	/* threads for user processes should have detached from their process
+	   in sys__exit */
+	KASSERT(curproc == kproc || curproc == NULL);	
+	/* kernel threads don't go through sys__exit, so we detach them from kproc here */
+	if (curproc == kproc) {
+	  proc_remthread(cur);
+	}
+#else // UW
+	proc_remthread(cur);
+#endif // UW
+
+	/* Make sure we *are* detached (move this only if you're sure!) */
+	KASSERT(cur->t_proc == NULL);
+
+	/* Check the stack guard band. */
+	thread_checkstack(cur);
+
+	/* Interrupts off on this processor */
+        splhigh();
+	thread_switch(S_ZOMBIE, NULL);
+	panic("The zombie walks!\n");
+}
+
+/*
+ * Yield the cpu to another process, but stay runnable.
+ */
+void
+thread_yield(void)
+{
+	thread_switch(S_READY, NULL);
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Scheduler.
+ *
+ * Threads are scheduled with a multi-level feedback queue. A thread
+ * that uses up its whole quantum drops a level, and one that blocks
+ * moves up a level; each level has its own quantum length. Threads
+ * at a higher level always run before threads at a lower one, so
+ * interactive and I/O-bound threads get the CPU quickly while CPU
+ * hogs share what's left. Threads on the same level are ordered by
+ * their processes' fair share; see SCHED_VTICK.
+ */
+
+unsigned
+thread_niceweight(int nice)
+{
+	if (nice < PRIO_MIN) {
+		nice = PRIO_MIN;
+	}
+	if (nice > PRIO_MAX) {
+		nice = PRIO_MAX;
+	}
+	return sched_weights[nice - PRIO_MIN];
+}
+
+/*
+ * Charge T's process for the hardclock T just used.
+ */
+static
+void
+thread_charge(struct thread *t)
+{
+	struct proc *p = t->t_proc;
+
+	if (p == NULL) {
+		return;
+	}
+	spinlock_acquire(&p->p_schedlock);
+	p->p_cputicks++;
+	if (t->t_policy == SCHED_OTHER) {
+		p->p_vruntime += SCHED_VTICK / p->p_weight;
+	}
+	spinlock_release(&p->p_schedlock);
+}
+
+void
+thread_tick(void)
+{
+	struct thread *cur;
+	bool preempt = false;
+	unsigned i;
+
+	/* The idle loop has nothing to charge. */
+	if (curcpu->c_isidle) {
+		return;
+	}
+
+	cur = curthread;
+	thread_charge(cur);
+
+	/*
+	 * Real-time threads have no quantum and keep the cpu until
+	 * they block, unless they've used up their share of this
+	 * second and time-sharing threads are waiting.
+	 */
+	if (cur->t_policy == SCHED_FIFO) {
+		curcpu->c_rtticks++;
+		if (curcpu->c_rtticks >= SCHED_RTLIMIT &&
+		    !curcpu->c_rtthrottled) {
+			spinlock_acquire(&curcpu->c_runqueue_lock);
+			curcpu->c_rtthrottled = true;
+			curcpu->c_rtthrottles++;
+			spinlock_release(&curcpu->c_runqueue_lock);
+		}
+		if (curcpu->c_rtthrottled && curcpu->c_runcount > 0) {
+			curcpu->c_needresched = true;
+		}
+		return;
+	}
+
+	KASSERT(cur->t_ticksleft > 0);
+	cur->t_ticksleft--;
+	if (cur->t_ticksleft == 0) {
+		if (cur->t_priority < SCHED_NLEVELS - 1) {
+			cur->t_priority++;
+		}
+		cur->t_ticksleft = sched_quantum[cur->t_priority];
+		preempt = true;
+	}
+
+	/*
+	 * With nothing else waiting here, yielding would only pick
+	 * this thread again. c_runcount is read without the lock; if
+	 * another cpu is adding a thread right now, the next tick
+	 * will see it.
+	 */
+	if (curcpu->c_runcount == 0) {
+		if (preempt) {
+			curcpu->c_quietticks++;
+		}
+		return;
+	}
+
+	if (!preempt) {
+		spinlock_acquire(&curcpu->c_runqueue_lock);
+		for (i=0; i<THREAD_QUEUE(cur); i++) {
+			if (i == SCHED_RTQUEUE && curcpu->c_rtthrottled) {
+				continue;
+			}
+			if (!threadlist_isempty(&curcpu->c_runqueue[i])) {
+				preempt = true;
+				break;
+			}
 		}
+		spinlock_release(&curcpu->c_runqueue_lock);
 	}
-#endif
 
-	/* Call the function. */
-	entrypoint(data1, data2);
+	if (preempt) {
+		curcpu->c_needresched = true;
+	}
+}
 
-	/* Done. */
-	thread_exit();
+void
+thread_preempt_disable(void)
+{
+	curthread->t_nopreempt++;
+}
+
+void
+thread_preempt_enable(void)
+{
+	KASSERT(curthread->t_nopreempt > 0);
+	curthread->t_nopreempt--;
+	if (curthread->t_nopreempt == 0) {
+		thread_preempt_point();
+	}
 }
 
 /*
- * Cause the current thread to exit.
- *
- * The parts of the thread structure we don't actually need to run
- * should be cleaned up right away. The rest has to wait until
- * thread_destroy is called from exorcise().
- *
- * Does not return.
+ * Yield if a reschedule is pending and nothing forbids it: not in an
+ * interrupt, no spinlock held or spl raised, not in a
+ * thread_preempt_disable section.
  */
 void
-thread_exit(void)
+thread_preempt_point(void)
 {
-	struct thread *cur;
-
-	cur = curthread;
+	struct thread *cur = curthread;
 
-#ifdef UW
-	/* threads for user processes should have detached from their process
-	   in sys__exit */
-	KASSERT(curproc == kproc || curproc == NULL);	
-	/* kernel threads don't go through sys__exit, so we detach them from kproc here */
-	if (curproc == kproc) {
-	  proc_remthread(cur);
+	if (!curcpu->c_needresched) {
+		return;
 	}
-#else // UW
-	proc_remthread(cur);
-#endif // UW
-
-	/* Make sure we *are* detached (move this only if you're sure!) */
-	KASSERT(cur->t_proc == NULL);
-
-	/* Check the stack guard band. */
-	thread_checkstack(cur);
-
-	/* Interrupts off on this processor */
-        splhigh();
-	thread_switch(S_ZOMBIE, NULL);
-	panic("The zombie walks!\n");
+	if (cur->t_in_interrupt || cur->t_curspl > 0 ||
+	    cur->t_nopreempt > 0 || curcpu->c_isidle) {
+		return;
+	}
+	thread_yield();
 }
 
 /*
- * Yield the cpu to another process, but stay runnable.
+ * The interrupt code calls this when the interrupt came in with
+ * interrupts on, and so with no spinlocks held, while it's still
+ * running with them off; thread_yield works from here just as it
+ * does from an interrupt handler. The idle thread never sees this:
+ * it waits for interrupts with spl raised, and looks for work itself.
  */
 void
-thread_yield(void)
+thread_preempt_intr(void)
 {
-	thread_switch(S_READY, NULL);
-}
+	KASSERT(curthread->t_in_interrupt);
 
-////////////////////////////////////////////////////////////
+	if (!curcpu->c_needresched || curthread->t_nopreempt > 0 ||
+	    curcpu->c_isidle) {
+		return;
+	}
+	curcpu->c_preemptions++;
+	thread_yield();
+}
 
 /*
- * Scheduler.
- *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is called periodically from hardclock(). To keep CPU-bound
+ * threads from starving, and to let a thread that has changed from
+ * computing to interacting get back up, it moves everything on this
+ * cpu back to the top level. It also starts real-time threads on a
+ * fresh allowance.
  */
-
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct threadlist *top;
+	struct thread *t;
+	unsigned i;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	curcpu->c_rtticks = 0;
+	curcpu->c_rtthrottled = false;
+
+	top = &curcpu->c_runqueue[SCHED_TSQUEUE(0)];
+	for (i=1; i<SCHED_NLEVELS; i++) {
+		while ((t = threadlist_remhead(
+				&curcpu->c_runqueue[SCHED_TSQUEUE(i)])) != NULL) {
+			t->t_priority = 0;
+			t->t_ticksleft = sched_quantum[0];
+			threadlist_addtail(top, t);
+		}
+	}
+	if (!curcpu->c_isidle) {
+		curthread->t_priority = 0;
+		curthread->t_ticksleft = sched_quantum[0];
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
 }
 
 /*
@@ -848,9 +1917,13 @@ schedule(void)
  * and the performance loss due to underutilization of some CPUs is
  * something that needs to be tuned and probably is workload-specific.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * System/161 does not (yet) model such cache effects, but we still
+ * leave alone threads that ran or arrived here within the last
+ * SCHED_CACHEHOT hardclocks, so the same thread isn't bounced from
+ * cpu to cpu every period.
+ *
+ * Threads whose affinity mask no longer includes this cpu are always
+ * moved, whatever the load.
  */
 void
 thread_consider_migration(void)
@@ -858,19 +1931,19 @@ thread_consider_migration(void)
 	unsigned my_count, total_count, one_share, to_send;
 	unsigned i, numcpus;
 	struct cpu *c;
-	struct threadlist victims;
 	struct thread *t;
 
+	thread_push_disallowed();
+
+	/* The counts are only hints, so don't bother locking. */
 	my_count = total_count = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
+		total_count += c->c_runcount;
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			my_count = c->c_runcount;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
 
 	one_share = DIVROUNDUP(total_count, numcpus);
@@ -879,82 +1952,161 @@ thread_consider_migration(void)
 	}
 
 	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
-	}
-	spinlock_release(&curcpu->c_runqueue_lock);
-
 	for (i=0; i < numcpus && to_send > 0; i++) {
 		c = cpuarray_get(&allcpus, i);
 		if (c == curcpu->c_self) {
 			continue;
 		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
+		while (c->c_runcount < one_share && to_send > 0) {
+			spinlock_acquire(&curcpu->c_runqueue_lock);
+			t = runqueue_remmovable(curcpu, c, false);
+			spinlock_release(&curcpu->c_runqueue_lock);
+			if (t == NULL) {
+				break;
 			}
-
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			thread_moveto(t, c);
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
+			curcpu->c_migrations++;
 			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
+}
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+/*
+ * Work stealing.
+ *
+ * Called by a cpu that has nothing to run, from the idle loop, with
+ * interrupts off but without its run queue lock. Picks the peer with
+ * the most threads waiting, going by the unlocked c_runcount hints,
+ * and takes the thread that peer would have run last among those
+ * allowed to run here. Returns true if it got one.
+ *
+ * This is the pull side of load balancing; thread_consider_migration
+ * is the push side, run periodically by busy cpus.
+ */
+static
+bool
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct thread *t;
+	unsigned i, numcpus, load, maxload;
+
+	victim = NULL;
+	maxload = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
 		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+		load = c->c_runcount;
+		if (load > maxload) {
+			maxload = load;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return false;
+	}
+
+	/* An idle cpu is better off with a cache-hot thread than none. */
+	spinlock_acquire(&victim->c_runqueue_lock);
+	t = runqueue_remmovable(victim, curcpu->c_self, true);
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (t == NULL) {
+		return false;
+	}
+
+	DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+	      t->t_name, victim->c_number, curcpu->c_number);
+	thread_moveto(t, curcpu->c_self);
+	curcpu->c_steals++;
+	return true;
+}
+
+int
+thread_setaffinity(uint32_t mask)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+	bool any = false;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c->c_number >= 32 || (mask & (1U << c->c_number))) {
+			any = true;
+		}
+	}
+	if (!any) {
+		return EINVAL;
+	}
+
+	curthread->t_affinity = mask;
+	if (!THREAD_ALLOWED(curthread, curcpu->c_self)) {
+		/* Switching out lets the idle loop send us away. */
+		thread_yield();
+	}
+	return 0;
+}
+
+void
+thread_printstats(void)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	kprintf("cpu  runnable  hardclocks   skipped     quiet"
+		"    steals  migrations  forkedout  rtthrottled\n");
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		kprintf("%3u  %8u  %10u  %8u  %8u  %8u  %10u  %9u  %11u\n",
+			c->c_number, c->c_runcount, c->c_hardclocks,
+			c->c_idleticks, c->c_quietticks, c->c_steals,
+			c->c_migrations, c->c_forkedout, c->c_rtthrottles);
 	}
+}
+
+/*
+ * Print the context switch statistics. Each histogram row counts
+ * the intervals shorter than its label and at least as long as the
+ * row above; the last row counts everything longer.
+ */
+void
+thread_printlatency(void)
+{
+	struct cpu *c;
+	unsigned i, b, numcpus;
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	if (!sched_timing) {
+		kprintf("Wait and slice timing is off.\n");
+	}
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		kprintf("cpu%u: %u switches (%u voluntary, %u involuntary, "
+			"%u preempted), idle %u times for %llu ms\n",
+			c->c_number, c->c_switches, c->c_voluntary,
+			c->c_involuntary, c->c_preemptions, c->c_idles,
+			(unsigned long long)(c->c_idletime / 1000));
+		kprintf("    longest wait to run: %u us\n", c->c_maxwait);
+		kprintf("    %10s  %10s  %10s\n", "", "wait", "slice");
+		for (b=0; b<SCHED_HISTSIZE; b++) {
+			if (b < SCHED_HISTSIZE - 1) {
+				kprintf("    < %6u us", 64U << b);
+			}
+			else {
+				kprintf("    %11s", "longer");
+			}
+			kprintf("  %10u  %10u\n", c->c_waithist[b],
+				c->c_slicehist[b]);
+		}
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -963,6 +2115,44 @@ thread_consider_migration(void)
  * Wait channel functions
  */
 
+static struct objcache *wchan_cache;
+
+/*
+ * Object cache constructor and destructor. Free wait channels are
+ * kept empty and unlocked, so they need no work between uses.
+ */
+static
+int
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_init(&wc->wc_lock);
+	threadlist_init(&wc->wc_threads);
+	wc->wc_name = NULL;
+	return 0;
+}
+
+static
+void
+wchan_dtor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_cleanup(&wc->wc_lock);
+	threadlist_cleanup(&wc->wc_threads);
+}
+
+void
+wchan_bootstrap(void)
+{
+	wchan_cache = objcache_create("wchan", sizeof(struct wchan),
+				      wchan_ctor, wchan_dtor);
+	if (wchan_cache == NULL) {
+		panic("wchan_bootstrap: Out of memory\n");
+	}
+}
+
 /*
  * Create a wait channel. NAME is a symbolic string name for it.
  * This is what's displayed by ps -alx in Unix.
@@ -976,26 +2166,33 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = objcache_alloc(wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	spinlock_init(&wc->wc_lock);
-	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
 	return wc;
 }
 
 /*
  * Destroy a wait channel. Must be empty and unlocked.
- * (The corresponding cleanup functions require this.)
  */
 void
 wchan_destroy(struct wchan *wc)
 {
-	spinlock_cleanup(&wc->wc_lock);
-	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	KASSERT(threadlist_isempty(&wc->wc_threads));
+	wc->wc_name = NULL;
+	objcache_free(wchan_cache, wc);
+}
+
+/*
+ * Change a wait channel's name, for objects that keep their wait
+ * channel across uses. The same rules apply as for wchan_create.
+ */
+void
+wchan_setname(struct wchan *wc, const char *name)
+{
+	wc->wc_name = name;
 }
 
 /*
@@ -1028,6 +2225,70 @@ wchan_sleep(struct wchan *wc)
 	thread_switch(S_SLEEP, wc);
 }
 
+/*
+ * State shared between wchan_sleep_timeout and its timer.
+ */
+struct wchan_timeout {
+	struct wchan *wt_wchan;
+	struct thread *wt_thread;
+	bool wt_expired;
+};
+
+/*
+ * Timer function for wchan_sleep_timeout. Runs from hardclock.
+ */
+static
+void
+wchan_timeout(void *data)
+{
+	struct wchan_timeout *wt = data;
+	struct wchan *wc = wt->wt_wchan;
+	struct thread *target = wt->wt_thread;
+
+	spinlock_acquire(&wc->wc_lock);
+	if (target->t_wchan != wc) {
+		/* Somebody woke it up already. */
+		spinlock_release(&wc->wc_lock);
+		return;
+	}
+	threadlist_remove(&wc->wc_threads, target);
+	target->t_wchan = NULL;
+	wt->wt_expired = true;
+	spinlock_release(&wc->wc_lock);
+
+	thread_make_runnable(target, false);
+}
+
+/*
+ * Go to sleep on a wait channel, but for no more than TICKS
+ * hardclocks. The channel must be locked, and will be *unlocked* upon
+ * return.
+ *
+ * The timer is added while the channel is still locked, which keeps
+ * it from going off before we're on the channel's list.
+ */
+int
+wchan_sleep_timeout(struct wchan *wc, unsigned ticks)
+{
+	struct wchan_timeout wt;
+	struct timer tm;
+
+	/* may not sleep in an interrupt handler */
+	KASSERT(!curthread->t_in_interrupt);
+
+	wt.wt_wchan = wc;
+	wt.wt_thread = curthread;
+	wt.wt_expired = false;
+	timer_init(&tm, wchan_timeout, &wt);
+	timer_add(&tm, ticks);
+
+	thread_switch(S_SLEEP, wc);
+
+	/* Once this returns the timer is done with wt. */
+	timer_cancel(&tm);
+	return wt.wt_expired ? ETIMEDOUT : 0;
+}
+
 /*
  * Wake up one thread sleeping on a wait channel.
  */
@@ -1039,6 +2300,9 @@ wchan_wakeone(struct wchan *wc)
 	/* Lock the channel and grab a thread from it */
 	spinlock_acquire(&wc->wc_lock);
 	target = threadlist_remhead(&wc->wc_threads);
+	if (target != NULL) {
+		target->t_wchan = NULL;
+	}
 	/*
 	 * Nobody else can wake up this thread now, so we don't need
 	 * to hang onto the lock.
@@ -1070,6 +2334,7 @@ wchan_wakeall(struct wchan *wc)
 	 */
 	spinlock_acquire(&wc->wc_lock);
 	while ((target = threadlist_remhead(&wc->wc_threads)) != NULL) {
+		target->t_wchan = NULL;
 		threadlist_addtail(&list, target);
 	}
 	/*
@@ -1155,6 +2420,7 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 		target->c_shootdown[n] = *mapping;
 		target->c_numshootdown = n+1;
 	}
+	target->c_shootdowns_posted++;
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
@@ -1162,6 +2428,44 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+void
+ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping)
+{
+	unsigned i;
+	struct cpu *c;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self) {
+			ipi_tlbshootdown(c, mapping);
+		}
+	}
+}
+
+void
+ipi_tlbshootdown_wait(void)
+{
+	unsigned i, target;
+	struct cpu *c;
+
+	KASSERT(curthread->t_curspl == 0);
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		spinlock_acquire(&c->c_ipi_lock);
+		target = c->c_shootdowns_posted;
+		spinlock_release(&c->c_ipi_lock);
+
+		/* Counts wrap; compare the difference. */
+		while ((int)(c->c_shootdowns_done - target) < 0) {
+			/* spin */
+		}
+	}
+}
+
 void
 interprocessor_interrupt(void)
 {
@@ -1202,6 +2506,7 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdowns_done = curcpu->c_shootdowns_posted;
 	}
 
 	curcpu->c_ipi_pending = 0;
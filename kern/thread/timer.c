@@ -0,0 +1,301 @@
+/*
+ * Kernel timers. See timer.h for the interface.
+ *
+ * Each wheel's tw_now is the first tick it has not processed yet. It
+ * normally equals its cpu's c_hardclocks plus one, but may fall
+ * behind while the cpu is coming out of tickless idle; the next
+ * timer_hardclock catches it up. A timer's slot is chosen by how far
+ * its expiry is from tw_now, and a slot on level N > 0 is moved down
+ * when the low bits of tw_now wrap around to it.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <timer.h>
+
+#define TW_BITS    6
+#define TW_SIZE    (1U << TW_BITS)	/* slots per level */
+#define TW_MASK    (TW_SIZE - 1)
+#define TW_LEVELS  4
+
+struct timerwheel {
+	struct spinlock tw_lock;
+	unsigned tw_now;			/* next tick to process */
+	unsigned tw_count[TW_LEVELS];		/* timers on each level */
+	struct timer *tw_slots[TW_LEVELS][TW_SIZE];
+};
+
+struct timerwheel *
+timerwheel_create(void)
+{
+	struct timerwheel *tw;
+	unsigned i, j;
+
+	tw = kmalloc(sizeof(*tw));
+	if (tw == NULL) {
+		return NULL;
+	}
+	spinlock_init(&tw->tw_lock);
+	tw->tw_now = 0;
+	for (i=0; i<TW_LEVELS; i++) {
+		tw->tw_count[i] = 0;
+		for (j=0; j<TW_SIZE; j++) {
+			tw->tw_slots[i][j] = NULL;
+		}
+	}
+	return tw;
+}
+
+void
+timerwheel_destroy(struct timerwheel *tw)
+{
+	unsigned i;
+
+	for (i=0; i<TW_LEVELS; i++) {
+		KASSERT(tw->tw_count[i] == 0);
+	}
+	spinlock_cleanup(&tw->tw_lock);
+	kfree(tw);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Wheel manipulation. All of these require tw_lock.
+
+/*
+ * Put a timer in the slot for its expiry time.
+ */
+static
+void
+tw_place(struct timerwheel *tw, struct timer *tm)
+{
+	struct timer **slot;
+	unsigned delta, level;
+
+	delta = tm->tmr_expires - tw->tw_now;
+	if (delta > TIMER_MAXTICKS) {
+		/* Either too far off or already overdue. */
+		delta = (int)delta < 0 ? 0 : TIMER_MAXTICKS;
+		tm->tmr_expires = tw->tw_now + delta;
+	}
+
+	for (level = 0; level < TW_LEVELS - 1; level++) {
+		if (delta < (1U << (TW_BITS * (level + 1)))) {
+			break;
+		}
+	}
+	slot = &tw->tw_slots[level]
+		[(tm->tmr_expires >> (TW_BITS * level)) & TW_MASK];
+
+	tm->tmr_level = level;
+	tm->tmr_next = *slot;
+	tm->tmr_pprev = slot;
+	if (*slot != NULL) {
+		(*slot)->tmr_pprev = &tm->tmr_next;
+	}
+	*slot = tm;
+	tw->tw_count[level]++;
+}
+
+static
+void
+tw_remove(struct timerwheel *tw, struct timer *tm)
+{
+	*tm->tmr_pprev = tm->tmr_next;
+	if (tm->tmr_next != NULL) {
+		tm->tmr_next->tmr_pprev = tm->tmr_pprev;
+	}
+	tm->tmr_next = NULL;
+	tm->tmr_pprev = NULL;
+	KASSERT(tw->tw_count[tm->tmr_level] > 0);
+	tw->tw_count[tm->tmr_level]--;
+}
+
+/*
+ * Move every timer in one slot of LEVEL down to where it now belongs.
+ * Returns the slot's index, so the caller knows whether this level
+ * has wrapped too.
+ */
+static
+unsigned
+tw_cascade(struct timerwheel *tw, unsigned level)
+{
+	struct timer *tm, *list;
+	unsigned index;
+
+	index = (tw->tw_now >> (TW_BITS * level)) & TW_MASK;
+	list = tw->tw_slots[level][index];
+	tw->tw_slots[level][index] = NULL;
+	while (list != NULL) {
+		tm = list;
+		list = tm->tmr_next;
+		KASSERT(tw->tw_count[level] > 0);
+		tw->tw_count[level]--;
+		tw_place(tw, tm);
+	}
+	return index;
+}
+
+/*
+ * Process tick tw_now.
+ */
+static
+void
+tw_tick(struct timerwheel *tw)
+{
+	struct timer *tm, *list;
+	unsigned index, level;
+
+	index = tw->tw_now & TW_MASK;
+	for (level = 1; index == 0 && level < TW_LEVELS; level++) {
+		index = tw_cascade(tw, level);
+	}
+
+	index = tw->tw_now & TW_MASK;
+	list = tw->tw_slots[0][index];
+	tw->tw_slots[0][index] = NULL;
+	while (list != NULL) {
+		tm = list;
+		list = tm->tmr_next;
+		KASSERT(tm->tmr_expires == tw->tw_now);
+		KASSERT(tw->tw_count[0] > 0);
+		tw->tw_count[0]--;
+		tm->tmr_next = NULL;
+		tm->tmr_pprev = NULL;
+		tm->tmr_func(tm->tmr_data);
+		/* Last; timer_cancel may free the timer once this is done. */
+		tm->tmr_cpu = NULL;
+	}
+
+	tw->tw_now++;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+void
+timer_init(struct timer *tm, void (*func)(void *data), void *data)
+{
+	tm->tmr_next = NULL;
+	tm->tmr_pprev = NULL;
+	tm->tmr_cpu = NULL;
+	tm->tmr_expires = 0;
+	tm->tmr_level = 0;
+	tm->tmr_func = func;
+	tm->tmr_data = data;
+}
+
+void
+timer_add(struct timer *tm, unsigned ticks)
+{
+	struct timerwheel *tw;
+	int spl;
+
+	KASSERT(tm->tmr_cpu == NULL);
+
+	if (ticks == 0) {
+		ticks = 1;
+	}
+	if (ticks > TIMER_MAXTICKS) {
+		ticks = TIMER_MAXTICKS;
+	}
+
+	/* Stay on this cpu while choosing its wheel. */
+	spl = splhigh();
+	tw = curcpu->c_timers;
+	spinlock_acquire(&tw->tw_lock);
+	tm->tmr_cpu = curcpu->c_self;
+	tm->tmr_expires = curcpu->c_hardclocks + ticks;
+	tw_place(tw, tm);
+	spinlock_release(&tw->tw_lock);
+	splx(spl);
+}
+
+bool
+timer_cancel(struct timer *tm)
+{
+	struct cpu *c;
+	struct timerwheel *tw;
+
+	/*
+	 * The timer's function runs with its wheel locked and clears
+	 * tmr_cpu afterwards, so once we hold the lock of the wheel
+	 * it's on (if any) it cannot be running.
+	 */
+	while (1) {
+		c = *(struct cpu *volatile *)&tm->tmr_cpu;
+		if (c == NULL) {
+			return false;
+		}
+		tw = c->c_timers;
+		spinlock_acquire(&tw->tw_lock);
+		if (tm->tmr_cpu == c) {
+			break;
+		}
+		spinlock_release(&tw->tw_lock);
+	}
+
+	tw_remove(tw, tm);
+	tm->tmr_cpu = NULL;
+	spinlock_release(&tw->tw_lock);
+	return true;
+}
+
+void
+timer_hardclock(void)
+{
+	struct timerwheel *tw = curcpu->c_timers;
+
+	spinlock_acquire(&tw->tw_lock);
+	while ((int)(curcpu->c_hardclocks - tw->tw_now) >= 0) {
+		tw_tick(tw);
+	}
+	spinlock_release(&tw->tw_lock);
+}
+
+unsigned
+timer_nextdelay(unsigned limit)
+{
+	struct timerwheel *tw = curcpu->c_timers;
+	unsigned when = 0, i, level, delay;
+	bool found = false;
+
+	spinlock_acquire(&tw->tw_lock);
+
+	/* The earliest timer on level 0 is exact... */
+	for (i=0; i<TW_SIZE && tw->tw_count[0] > 0; i++) {
+		if (tw->tw_slots[0][(tw->tw_now + i) & TW_MASK] != NULL) {
+			when = tw->tw_now + i;
+			found = true;
+			break;
+		}
+	}
+
+	/* ...higher levels are only known to wait for the next cascade. */
+	for (level = 1; level < TW_LEVELS; level++) {
+		if (tw->tw_count[level] > 0) {
+			i = ROUNDUP(tw->tw_now, TW_SIZE);
+			if (!found || (int)(i - when) < 0) {
+				when = i;
+				found = true;
+			}
+			break;
+		}
+	}
+
+	spinlock_release(&tw->tw_lock);
+
+	if (!found) {
+		return limit;
+	}
+	delay = when - curcpu->c_hardclocks;
+	if ((int)delay <= 0) {
+		return 1;
+	}
+	return delay < limit ? delay : limit;
+}
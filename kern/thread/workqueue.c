@@ -0,0 +1,433 @@
+/*
+ * Deferred work. See workqueue.h for the interface.
+ *
+ * Each cpu has a pool: a FIFO of queued work and a worker thread,
+ * pinned to that cpu, that runs it. The pool's wait channel lock
+ * protects the pool; the worker sleeps on the channel when there's
+ * nothing to do, and so does anyone waiting for a work function to
+ * finish, so the channel is woken with wchan_wakeall.
+ *
+ * Lock order: a work item's w_lock, then the timing wheel (for
+ * delayed work, whose timer function queues it), then the pool.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <cpu.h>
+#include <current.h>
+#include <timer.h>
+#include <workqueue.h>
+
+struct workpool {
+	struct wchan *wp_wchan;		/* its lock protects the rest */
+	struct work *wp_head;		/* queued work, oldest first */
+	struct work *wp_tail;
+	struct work *wp_current;	/* work whose function is running */
+	unsigned wp_cpunum;		/* cpu the worker runs on */
+	struct thread *wp_worker;	/* the worker, once it's started */
+	struct workpool *wp_nextpool;	/* list of all pools */
+
+	/* Statistics */
+	unsigned wp_depth;		/* items queued now */
+	unsigned wp_maxdepth;		/* most items queued at once */
+	unsigned wp_queued;		/* items ever queued */
+	unsigned wp_ran;		/* work functions run */
+	unsigned wp_cancelled;		/* items taken off by work_cancel */
+};
+
+/*
+ * All the pools, newest first. Pools are only added, while cpus are
+ * being created, and never removed while the system is up.
+ */
+static struct workpool *workpools;
+static struct spinlock workpools_lock = SPINLOCK_INITIALIZER;
+
+/* Set once the workers exist. */
+static bool workqueue_started;
+
+struct workpool *
+workpool_create(unsigned cpunum)
+{
+	struct workpool *wp;
+
+	wp = kmalloc(sizeof(*wp));
+	if (wp == NULL) {
+		return NULL;
+	}
+	wp->wp_wchan = wchan_create("workpool");
+	if (wp->wp_wchan == NULL) {
+		kfree(wp);
+		return NULL;
+	}
+	wp->wp_head = NULL;
+	wp->wp_tail = NULL;
+	wp->wp_current = NULL;
+	wp->wp_cpunum = cpunum;
+	wp->wp_worker = NULL;
+	wp->wp_depth = 0;
+	wp->wp_maxdepth = 0;
+	wp->wp_queued = 0;
+	wp->wp_ran = 0;
+	wp->wp_cancelled = 0;
+
+	spinlock_acquire(&workpools_lock);
+	wp->wp_nextpool = workpools;
+	workpools = wp;
+	spinlock_release(&workpools_lock);
+
+	return wp;
+}
+
+void
+workpool_destroy(struct workpool *wp)
+{
+	struct workpool **pp;
+
+	KASSERT(wp->wp_head == NULL);
+	KASSERT(wp->wp_current == NULL);
+
+	spinlock_acquire(&workpools_lock);
+	for (pp = &workpools; *pp != wp; pp = &(*pp)->wp_nextpool) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = wp->wp_nextpool;
+	spinlock_release(&workpools_lock);
+
+	wchan_destroy(wp->wp_wchan);
+	kfree(wp);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Pool queue
+
+/*
+ * Add W to the end of WP's queue and wake the worker. W must already
+ * be marked pending.
+ */
+static
+void
+workpool_append(struct workpool *wp, struct work *w)
+{
+	wchan_lock(wp->wp_wchan);
+	w->w_next = NULL;
+	if (wp->wp_tail == NULL) {
+		wp->wp_head = w;
+	}
+	else {
+		wp->wp_tail->w_next = w;
+	}
+	wp->wp_tail = w;
+	wp->wp_queued++;
+	wp->wp_depth++;
+	if (wp->wp_depth > wp->wp_maxdepth) {
+		wp->wp_maxdepth = wp->wp_depth;
+	}
+	wchan_unlock(wp->wp_wchan);
+	wchan_wakeall(wp->wp_wchan);
+}
+
+/*
+ * Take W off WP's queue if it's there. Call with the pool locked.
+ */
+static
+bool
+workpool_remove(struct workpool *wp, struct work *w)
+{
+	struct work *prev, *cur;
+
+	prev = NULL;
+	for (cur = wp->wp_head; cur != NULL; cur = cur->w_next) {
+		if (cur == w) {
+			if (prev == NULL) {
+				wp->wp_head = w->w_next;
+			}
+			else {
+				prev->w_next = w->w_next;
+			}
+			if (wp->wp_tail == w) {
+				wp->wp_tail = prev;
+			}
+			w->w_next = NULL;
+			wp->wp_depth--;
+			wp->wp_cancelled++;
+			return true;
+		}
+		prev = cur;
+	}
+	return false;
+}
+
+/*
+ * Timer function for delayed work. Runs on the cpu that queued the
+ * work, so w_pool is that cpu's pool.
+ */
+static
+void
+work_timeout(void *data)
+{
+	struct work *w = data;
+
+	workpool_append(w->w_pool, w);
+}
+
+static
+void
+workpool_thread(void *data1, unsigned long data2)
+{
+	struct workpool *wp = data1;
+	struct work *w;
+	void (*func)(void *);
+	void *data;
+
+	(void)data2;
+
+	wp->wp_worker = curthread;
+
+	/* Cpus numbered 32 and up can't be named in a mask. */
+	if (wp->wp_cpunum < 32) {
+		thread_setaffinity((uint32_t)1 << wp->wp_cpunum);
+	}
+
+	while (1) {
+		wchan_lock(wp->wp_wchan);
+		while (wp->wp_head == NULL) {
+			wchan_sleep(wp->wp_wchan);
+			wchan_lock(wp->wp_wchan);
+		}
+		w = wp->wp_head;
+		wp->wp_head = w->w_next;
+		if (wp->wp_head == NULL) {
+			wp->wp_tail = NULL;
+		}
+		w->w_next = NULL;
+		wp->wp_depth--;
+		wp->wp_current = w;
+		wchan_unlock(wp->wp_wchan);
+
+		/*
+		 * Once it's no longer pending the item may be queued
+		 * again or freed, so copy out what we need first.
+		 */
+		spinlock_acquire(&w->w_lock);
+		func = w->w_func;
+		data = w->w_data;
+		w->w_pending = false;
+		spinlock_release(&w->w_lock);
+
+		func(data);
+
+		wchan_lock(wp->wp_wchan);
+		wp->wp_current = NULL;
+		wp->wp_ran++;
+		wchan_unlock(wp->wp_wchan);
+		wchan_wakeall(wp->wp_wchan);
+	}
+}
+
+void
+workqueue_bootstrap(void)
+{
+	struct workpool *wp;
+	char name[16];
+	int result;
+
+	for (wp = workpools; wp != NULL; wp = wp->wp_nextpool) {
+		snprintf(name, sizeof(name), "worker/%u", wp->wp_cpunum);
+		result = thread_fork(name, NULL, workpool_thread, wp, 0);
+		if (result) {
+			panic("workqueue_bootstrap: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	workqueue_started = true;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+void
+work_init(struct work *w, void (*func)(void *data), void *data)
+{
+	spinlock_init(&w->w_lock);
+	w->w_pending = false;
+	w->w_pool = NULL;
+	w->w_next = NULL;
+	timer_init(&w->w_timer, work_timeout, w);
+	w->w_func = func;
+	w->w_data = data;
+}
+
+void
+work_cleanup(struct work *w)
+{
+	KASSERT(!w->w_pending);
+	spinlock_cleanup(&w->w_lock);
+}
+
+/*
+ * Queue W on this cpu's pool, right away if TICKS is 0 and otherwise
+ * when its timer goes off. Holding w_lock keeps us on this cpu.
+ */
+static
+bool
+work_queue(struct work *w, unsigned ticks)
+{
+	struct workpool *wp;
+
+	spinlock_acquire(&w->w_lock);
+	if (w->w_pending) {
+		spinlock_release(&w->w_lock);
+		return false;
+	}
+	wp = curcpu->c_workpool;
+	w->w_pending = true;
+	w->w_pool = wp;
+	if (ticks == 0) {
+		workpool_append(wp, w);
+	}
+	else {
+		timer_add(&w->w_timer, ticks);
+	}
+	spinlock_release(&w->w_lock);
+	return true;
+}
+
+bool
+work_enqueue(struct work *w)
+{
+	return work_queue(w, 0);
+}
+
+bool
+work_enqueue_delayed(struct work *w, unsigned ticks)
+{
+	return work_queue(w, ticks == 0 ? 1 : ticks);
+}
+
+/*
+ * Return the pool whose worker is running W's function, if any. Call
+ * without any pool locked; the answer is only a hint.
+ */
+static
+struct workpool *
+work_runningon(struct work *w)
+{
+	struct workpool *wp;
+
+	for (wp = workpools; wp != NULL; wp = wp->wp_nextpool) {
+		if (wp->wp_current == w) {
+			return wp;
+		}
+	}
+	return NULL;
+}
+
+bool
+work_cancel(struct work *w)
+{
+	struct workpool *wp;
+	bool cancelled = false, removed, pending;
+
+	KASSERT(!curthread->t_in_interrupt);
+
+	while (1) {
+		spinlock_acquire(&w->w_lock);
+		if (w->w_pending) {
+			removed = timer_cancel(&w->w_timer);
+			if (!removed) {
+				wp = w->w_pool;
+				wchan_lock(wp->wp_wchan);
+				removed = workpool_remove(wp, w);
+				wchan_unlock(wp->wp_wchan);
+			}
+			if (removed) {
+				w->w_pending = false;
+				cancelled = true;
+			}
+		}
+		pending = w->w_pending;
+		spinlock_release(&w->w_lock);
+
+		/*
+		 * Still pending means a worker has just taken it off
+		 * its queue; it'll show up as running momentarily.
+		 */
+		wp = work_runningon(w);
+		if (wp == NULL) {
+			if (!pending) {
+				return cancelled;
+			}
+			continue;
+		}
+
+		/* Wait for it to finish, then look again in case it requeued. */
+		KASSERT(wp->wp_worker != curthread);
+		wchan_lock(wp->wp_wchan);
+		if (wp->wp_current == w) {
+			wchan_sleep(wp->wp_wchan);
+		}
+		else {
+			wchan_unlock(wp->wp_wchan);
+		}
+	}
+}
+
+static
+void
+workqueue_barrier(void *data)
+{
+	volatile bool *done = data;
+
+	*done = true;
+}
+
+void
+workqueue_flush(void)
+{
+	struct workpool *wp;
+	struct work barrier;
+	volatile bool done;
+
+	KASSERT(!curthread->t_in_interrupt);
+	if (!workqueue_started) {
+		return;
+	}
+
+	/* Queue a no-op behind everything on each pool and wait for it. */
+	for (wp = workpools; wp != NULL; wp = wp->wp_nextpool) {
+		KASSERT(wp->wp_worker != curthread);
+		done = false;
+		work_init(&barrier, workqueue_barrier, (void *)&done);
+		barrier.w_pending = true;
+		barrier.w_pool = wp;
+		workpool_append(wp, &barrier);
+
+		wchan_lock(wp->wp_wchan);
+		while (!done || wp->wp_current == &barrier) {
+			wchan_sleep(wp->wp_wchan);
+			wchan_lock(wp->wp_wchan);
+		}
+		wchan_unlock(wp->wp_wchan);
+		work_cleanup(&barrier);
+	}
+}
+
+void
+workqueue_printstats(void)
+{
+	struct workpool *wp;
+
+	kprintf("cpu  queued now  max queued      queued         ran"
+		"   cancelled\n");
+	for (wp = workpools; wp != NULL; wp = wp->wp_nextpool) {
+		kprintf("%3u  %10u  %10u  %10u  %10u  %10u\n",
+			wp->wp_cpunum, wp->wp_depth, wp->wp_maxdepth,
+			wp->wp_queued, wp->wp_ran, wp->wp_cancelled);
+	}
+}
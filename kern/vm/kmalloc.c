@@ -28,9 +28,14 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <clock.h>
+#include <shrinker.h>
 
 /*
  * Kernel malloc.
@@ -89,6 +94,10 @@ static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
 #define SMALLEST_SUBPAGE_SIZE 16
 #define LARGEST_SUBPAGE_SIZE 2048
 
+/* Per-cpu magazine size, and how many blocks to move at once */
+#define KMAG_SIZE 16
+#define KMAG_BATCH 8
+
 #elif PAGE_SIZE == 8192
 #error "No support for 8k pages (yet?)"
 #else
@@ -103,7 +112,9 @@ struct freelist {
 
 struct pageref {
 	struct pageref *next_samesize;
+	struct pageref **pprev_samesize;	/* pointer to us in prev */
 	struct pageref *next_all;
+	struct pageref **pprev_all;
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
@@ -118,67 +129,162 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
- *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
- *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * Locking. kmalloc_spinlock protects the subpage pages and their
+ * pagerefs, and the list of per-cpu caches. Each cpu's cache of
+ * magazines (at the bottom of the file) has its own kc_lock, so most
+ * small allocations and frees only ever take that. Blocks sitting in
+ * magazines are still allocated as far as the pages are concerned;
+ * the shrinker drains them back when memory runs short.
+ */
+
+static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+
+////////////////////////////////////////
+
+/*
+ * Pagerefs live in whole pages of them, which are obtained from
+ * alloc_kpages as the heap grows and given back when they empty out.
+ * Each such page starts with a header holding a bitmap of the
+ * pagerefs in it that are in use. The pages are page-aligned, so the
+ * header for any pageref is found by masking its address.
  */
 
-#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
+#define PRP_INUSE_WORDS 8
+
+struct pagerefpage {
+	struct pagerefpage *next;
+	unsigned nfree;
+	uint32_t inuse[PRP_INUSE_WORDS];
+	struct pageref refs[];
+};
+
+#define NPAGEREFS_PER_PAGE \
+	((PAGE_SIZE - sizeof(struct pagerefpage)) / sizeof(struct pageref))
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+#define PR_PAGEREFPAGE(pr) \
+	((struct pagerefpage *)((vaddr_t)(pr) & PAGE_FRAME))
+
+static struct pagerefpage *pagerefpages;
+
+/* Total number of pagerefs, in use or not; for consistency checks */
+static unsigned npagerefs;
 
 static
 struct pageref *
-allocpageref(void)
+allocpageref_inpage(struct pagerefpage *prp)
 {
 	unsigned i,j;
 	uint32_t k;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
+	for (i=0; i<PRP_INUSE_WORDS; i++) {
+		if (prp->inuse[i]==0xffffffff) {
 			/* full */
 			continue;
 		}
 		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
+			if ((prp->inuse[i] & k)==0) {
+				KASSERT(i*32 + j < NPAGEREFS_PER_PAGE);
+				prp->inuse[i] |= k;
+				prp->nfree--;
+				return &prp->refs[i*32 + j];
 			}
 		}
 		KASSERT(0);
 	}
-
-	/* ran out */
+	KASSERT(0);
 	return NULL;
 }
 
+/*
+ * Get a pageref, adding another page of them if they're all in use.
+ * Called with kmalloc_spinlock held; may drop it and take it again.
+ */
 static
-void
+struct pageref *
+allocpageref(void)
+{
+	struct pagerefpage *prp;
+	vaddr_t newpage;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	COMPILE_ASSERT(NPAGEREFS_PER_PAGE <= PRP_INUSE_WORDS*32);
+
+	while (1) {
+		for (prp = pagerefpages; prp != NULL; prp = prp->next) {
+			if (prp->nfree > 0) {
+				return allocpageref_inpage(prp);
+			}
+		}
+
+		spinlock_release(&kmalloc_spinlock);
+		newpage = alloc_kpages(1);
+		spinlock_acquire(&kmalloc_spinlock);
+		if (newpage == 0) {
+			/* ran out */
+			return NULL;
+		}
+
+		prp = (struct pagerefpage *)newpage;
+		prp->nfree = NPAGEREFS_PER_PAGE;
+		for (i=0; i<PRP_INUSE_WORDS; i++) {
+			prp->inuse[i] = 0;
+		}
+		/* Mark the slots past the end of the page as used. */
+		for (i=NPAGEREFS_PER_PAGE; i<PRP_INUSE_WORDS*32; i++) {
+			prp->inuse[i/32] |= ((uint32_t)1) << (i%32);
+		}
+		prp->next = pagerefpages;
+		pagerefpages = prp;
+		npagerefs += NPAGEREFS_PER_PAGE;
+	}
+}
+
+/*
+ * Release a pageref. If that empties its page and there's room for
+ * more pagerefs elsewhere, the page is unlinked and its address
+ * returned; the caller should free_kpages it after dropping
+ * kmalloc_spinlock. Otherwise returns 0.
+ */
+static
+vaddr_t
 freepageref(struct pageref *p)
 {
+	struct pagerefpage *prp, **prpp;
 	size_t i, j;
 	uint32_t k;
+	bool spare = false;
 
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
+	prp = PR_PAGEREFPAGE(p);
+	j = p - prp->refs;
+	KASSERT(j < NPAGEREFS_PER_PAGE);  /* note: j is unsigned, don't test < 0 */
 	i = j/32;
 	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	KASSERT((prp->inuse[i] & k) != 0);
+	prp->inuse[i] &= ~k;
+	prp->nfree++;
+
+	if (prp->nfree < NPAGEREFS_PER_PAGE) {
+		return 0;
+	}
+
+	/* Keep the empty page unless some other page has room. */
+	for (prpp = &pagerefpages; *prpp != NULL; prpp = &(*prpp)->next) {
+		if (*prpp != prp && (*prpp)->nfree > 0) {
+			spare = true;
+			break;
+		}
+	}
+	if (!spare) {
+		return 0;
+	}
+
+	for (prpp = &pagerefpages; *prpp != prp; prpp = &(*prpp)->next) {
+		KASSERT(*prpp != NULL);
+	}
+	*prpp = prp->next;
+	npagerefs -= NPAGEREFS_PER_PAGE;
+	return (vaddr_t)prp;
 }
 
 ////////////////////////////////////////
@@ -186,16 +292,12 @@ freepageref(struct pageref *p)
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
-////////////////////////////////////////
+/* Set once kheap_bootstrap has attached pagerefs to their pages. */
+static bool kheap_pageowners;
 
-/*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
- */
-
-static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+/* At bottom of file */
+static struct shrinker kmag_shrinker;
+static unsigned kmag_count(size_t *bytes);
 
 ////////////////////////////////////////
 
@@ -260,14 +362,14 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(sc < npagerefs);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
+		KASSERT(ac < npagerefs);
 		ac++;
 	}
 
@@ -334,6 +436,8 @@ void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	unsigned nblocks;
+	size_t bytes;
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -345,32 +449,54 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	nblocks = kmag_count(&bytes);
+	kprintf("Per-cpu magazines: %u blocks (%lu bytes) cached\n",
+		nblocks, (unsigned long)bytes);
+}
+
+/*
+ * Record each existing subpage page's pageref as the page's owner in
+ * the coremap, so kfree can find it without searching. Called once
+ * the VM system is up; pages allocated after this are set up as
+ * they're allocated.
+ */
+void
+kheap_bootstrap(void)
+{
+	struct pageref *pr;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+		kpage_setowner(PR_PAGEADDR(pr), pr);
+	}
+	kheap_pageowners = true;
+	spinlock_release(&kmalloc_spinlock);
+
+	shrinker_register(&kmag_shrinker);
 }
 
 ////////////////////////////////////////
 
+/*
+ * Take a pageref off both lists. The back-pointers make this constant
+ * time, which keeps kfree constant time when it releases a page.
+ */
 static
 void
 remove_lists(struct pageref *pr, int blktype)
 {
-	struct pageref **guy;
-
 	KASSERT(blktype>=0 && blktype<NSIZES);
+	checksubpage(pr);
 
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_samesize;
-			break;
-		}
+	*pr->pprev_samesize = pr->next_samesize;
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->pprev_samesize = pr->pprev_samesize;
 	}
 
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_all;
-			break;
-		}
+	*pr->pprev_all = pr->next_all;
+	if (pr->next_all != NULL) {
+		pr->next_all->pprev_all = pr->pprev_all;
 	}
 }
 
@@ -392,6 +518,70 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Take a block off the freelist of a page that has one. Call with
+ * kmalloc_spinlock held.
+ */
+static
+void *
+subpage_takeblock(struct pageref *pr)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	void *retptr;
+
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+
+	return retptr;
+}
+
+/*
+ * Take up to MAX blocks of size class BLKTYPE from pages that already
+ * exist, with one trip through the lock. Returns the number found.
+ */
+static
+unsigned
+subpage_getblocks(unsigned blktype, void **blocks, unsigned max)
+{
+	struct pageref *pr;
+	unsigned n = 0;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+
+	for (pr = sizebases[blktype]; pr != NULL && n < max;
+	     pr = pr->next_samesize) {
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+		while (pr->nfree > 0 && n < max) {
+			blocks[n++] = subpage_takeblock(pr);
+		}
+	}
+
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+	return n;
+}
+
 static
 void *
 subpage_kmalloc(size_t sz)
@@ -423,25 +613,7 @@ subpage_kmalloc(size_t sz)
 
 		doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+			retptr = subpage_takeblock(pr);
 
 			checksubpages();
 
@@ -499,51 +671,57 @@ subpage_kmalloc(size_t sz)
 	KASSERT(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
 
 	pr->next_samesize = sizebases[blktype];
+	pr->pprev_samesize = &sizebases[blktype];
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->pprev_samesize = &pr->next_samesize;
+	}
 	sizebases[blktype] = pr;
 
 	pr->next_all = allbase;
+	pr->pprev_all = &allbase;
+	if (pr->next_all != NULL) {
+		pr->next_all->pprev_all = &pr->next_all;
+	}
 	allbase = pr;
 
+	/* Let kfree find the pageref from the page. */
+	if (kheap_pageowners) {
+		kpage_setowner(prpage, pr);
+	}
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
 
+/*
+ * Put a block back on its page's freelist. Call with kmalloc_spinlock
+ * held. If that leaves the page entirely free, the page is taken off
+ * the lists and its address stored in EMPTYPAGES[0], along with any
+ * page of pagerefs emptied with it in EMPTYPAGES[1], for the caller
+ * to free_kpages once it has dropped the lock. Returns the number of
+ * pages stored.
+ */
 static
-int
-subpage_kfree(void *ptr)
+unsigned
+subpage_putblock(struct pageref *pr, void *ptr, vaddr_t *emptypages)
 {
 	int blktype;		// index into sizes[] that we're using
 	vaddr_t ptraddr;	// same as ptr
-	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
 	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
+	vaddr_t prppage;	// emptied page of pagerefs, if any
 
-	ptraddr = (vaddr_t)ptr;
-
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
+	ptraddr = (vaddr_t)ptr;
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
 
-	if (pr==NULL) {
-		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
-		return -1;
-	}
+	/* check for corruption */
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	checksubpage(pr);
 
 	offset = ptraddr - prpage;
 
@@ -552,12 +730,6 @@ subpage_kfree(void *ptr)
 		panic("kfree: subpage free of invalid addr %p\n", ptr);
 	}
 
-	/*
-	 * Clear the block to 0xdeadbeef to make it easier to detect
-	 * uses of dangling pointers.
-	 */
-	fill_deadbeef(ptr, sizes[blktype]);
-
 	/*
 	 * We probably ought to check for free twice by seeing if the block
 	 * is already on the free list. But that's expensive, so we don't.
@@ -574,33 +746,707 @@ subpage_kfree(void *ptr)
 	pr->nfree++;
 
 	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+	if (pr->nfree < PAGE_SIZE / sizes[blktype]) {
+		return 0;
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+
+	/* Whole page is free. */
+	remove_lists(pr, blktype);
+	prppage = freepageref(pr);
+	emptypages[0] = prpage;
+	if (prppage != 0) {
+		emptypages[1] = prppage;
+		return 2;
+	}
+	return 1;
+}
+
+/*
+ * Find the pageref for a block, or NULL if it isn't a subpage block.
+ * Once the coremap is up, every subpage page records its pageref as
+ * the page's owner, and whole-page allocations have no owner. Since
+ * the caller still holds a block on the page, the page can't be freed
+ * out from under us, so no lock is needed.
+ */
+static
+struct pageref *
+subpage_lookup(void *ptr)
+{
+	vaddr_t ptraddr = (vaddr_t)ptr;
+	struct pageref *pr;
+
+	KASSERT(kheap_pageowners);
+	KASSERT(ptraddr >= MIPS_KSEG0 && ptraddr < MIPS_KSEG1);
+
+	pr = kpage_getowner(ptraddr & PAGE_FRAME);
+	KASSERT(pr == NULL || PR_PAGEADDR(pr) == (ptraddr & PAGE_FRAME));
+	return pr;
+}
+
+/*
+ * Return N blocks to their pages with one trip through the lock, and
+ * free any pages that empties. Returns the number of pages freed.
+ */
+static
+unsigned
+subpage_putblocks(void **blocks, unsigned n)
+{
+	vaddr_t emptypages[2 * KMAG_BATCH];
+	struct pageref *prs[KMAG_BATCH];
+	unsigned i, nempty = 0;
+
+	KASSERT(n <= KMAG_BATCH);
+
+	for (i=0; i<n; i++) {
+		prs[i] = subpage_lookup(blocks[i]);
+		KASSERT(prs[i] != NULL);
 	}
 
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
 	spinlock_acquire(&kmalloc_spinlock);
 	checksubpages();
+	for (i=0; i<n; i++) {
+		nempty += subpage_putblock(prs[i], blocks[i],
+					   &emptypages[nempty]);
+	}
+	checksubpages();
 	spinlock_release(&kmalloc_spinlock);
-#endif
 
+	/* Call free_kpages without kmalloc_spinlock. */
+	for (i=0; i<nempty; i++) {
+		free_kpages(emptypages[i]);
+	}
+	return nempty;
+}
+
+static
+int
+subpage_kfree(void *ptr)
+{
+	vaddr_t ptraddr;	// same as ptr
+	struct pageref *pr;	// pageref for page we're freeing in
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t emptypages[2];	// pages to free afterwards
+	unsigned i, nempty;
+
+	ptraddr = (vaddr_t)ptr;
+
+	if (kheap_pageowners) {
+		pr = subpage_lookup(ptr);
+		if (pr == NULL) {
+			/* Not a subpage allocation */
+			return -1;
+		}
+		spinlock_acquire(&kmalloc_spinlock);
+		checksubpages();
+	}
+	else {
+		/* Early in boot; search for it. */
+		spinlock_acquire(&kmalloc_spinlock);
+		checksubpages();
+		for (pr = allbase; pr; pr = pr->next_all) {
+			prpage = PR_PAGEADDR(pr);
+			if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
+				break;
+			}
+		}
+		if (pr==NULL) {
+			/* Not on any of our pages - not a subpage allocation */
+			spinlock_release(&kmalloc_spinlock);
+			return -1;
+		}
+	}
+
+	/*
+	 * Clear the block to 0xdeadbeef to make it easier to detect
+	 * uses of dangling pointers.
+	 */
+	fill_deadbeef(ptr, sizes[PR_BLOCKTYPE(pr)]);
+
+	nempty = subpage_putblock(pr, ptr, emptypages);
+
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	for (i=0; i<nempty; i++) {
+		free_kpages(emptypages[i]);
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+// Each cpu keeps a small stack (a "magazine") of free blocks of each
+// size. kmalloc and kfree use the current cpu's magazine when they
+// can, which takes only that cpu's own lock, and go to the shared
+// pages a batch at a time when it runs empty or full. Blocks sitting
+// in magazines still count as allocated as far as their pages are
+// concerned; the kmalloc shrinker flushes them back under memory
+// pressure so that their pages can be freed.
+//
+
+struct kmag {
+	unsigned km_count;
+	void *km_blocks[KMAG_SIZE];
+};
+
+struct kmalloc_cpucache {
+	struct spinlock kc_lock;
+	struct kmag kc_mags[NSIZES];
+	struct kmalloc_cpucache *kc_next;	/* list of all of them */
+};
+
+/* All the cpus' caches; protected by kmalloc_spinlock */
+static struct kmalloc_cpucache *kmag_allcaches;
+
+/*
+ * Get the current cpu's caches, creating them if need be. Returns
+ * NULL if they don't exist and can't be created.
+ */
+static
+struct kmalloc_cpucache *
+kmag_getcache(void)
+{
+	struct cpu *c;
+	struct kmalloc_cpucache *kc;
+	unsigned i;
+
+	c = curcpu->c_self;
+	if (c->c_kmcache != NULL) {
+		return c->c_kmcache;
+	}
+
+	kc = subpage_kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	spinlock_init(&kc->kc_lock);
+	for (i=0; i<NSIZES; i++) {
+		kc->kc_mags[i].km_count = 0;
+	}
+
+	/* We might have been preempted by someone doing the same. */
+	spinlock_acquire(&kmalloc_spinlock);
+	if (c->c_kmcache == NULL) {
+		kc->kc_next = kmag_allcaches;
+		kmag_allcaches = kc;
+		c->c_kmcache = kc;
+		kc = NULL;
+	}
+	spinlock_release(&kmalloc_spinlock);
+	if (kc != NULL) {
+		spinlock_cleanup(&kc->kc_lock);
+		subpage_kfree(kc);
+	}
+
+	return c->c_kmcache;
+}
+
+static
+void *
+kmag_alloc(size_t sz)
+{
+	struct kmalloc_cpucache *kc;
+	struct kmag *km;
+	void *blocks[KMAG_BATCH];
+	unsigned blktype, n;
+	void *ret = NULL;
+
+	kc = kmag_getcache();
+	if (kc == NULL) {
+		return subpage_kmalloc(sz);
+	}
+
+	blktype = blocktype(sz);
+	km = &kc->kc_mags[blktype];
+
+	spinlock_acquire(&kc->kc_lock);
+	if (km->km_count > 0) {
+		ret = km->km_blocks[--km->km_count];
+	}
+	spinlock_release(&kc->kc_lock);
+	if (ret != NULL) {
+		return ret;
+	}
+
+	/* Empty; refill from existing pages, or get a new page. */
+	n = subpage_getblocks(blktype, blocks, KMAG_BATCH);
+	if (n == 0) {
+		return subpage_kmalloc(sz);
+	}
+	ret = blocks[--n];
+
+	spinlock_acquire(&kc->kc_lock);
+	while (n > 0 && km->km_count < KMAG_SIZE) {
+		km->km_blocks[km->km_count++] = blocks[--n];
+	}
+	spinlock_release(&kc->kc_lock);
+
+	/* If someone else refilled it meanwhile, put the rest back. */
+	if (n > 0) {
+		subpage_putblocks(blocks, n);
+	}
+
+	return ret;
+}
+
+static
+void
+kmag_free(struct pageref *pr, void *ptr)
+{
+	struct kmalloc_cpucache *kc;
+	struct kmag *km;
+	void *blocks[KMAG_BATCH];
+	unsigned blktype, offset, n = 0;
+
+	blktype = PR_BLOCKTYPE(pr);
+	offset = (vaddr_t)ptr - PR_PAGEADDR(pr);
+	if (offset % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+	kc = kmag_getcache();
+	if (kc == NULL) {
+		subpage_kfree(ptr);
+		return;
+	}
+
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	km = &kc->kc_mags[blktype];
+	spinlock_acquire(&kc->kc_lock);
+	if (km->km_count == KMAG_SIZE) {
+		/* Full; flush a batch back to the pages. */
+		while (n < KMAG_BATCH) {
+			blocks[n++] = km->km_blocks[--km->km_count];
+		}
+	}
+	km->km_blocks[km->km_count++] = ptr;
+	spinlock_release(&kc->kc_lock);
+
+	if (n > 0) {
+		subpage_putblocks(blocks, n);
+	}
+}
+
+/*
+ * Empty one cpu's magazines back into the pages. Returns the number
+ * of pages that freed.
+ */
+static
+unsigned
+kmag_drain(struct kmalloc_cpucache *kc)
+{
+	void *blocks[KMAG_BATCH];
+	unsigned i, n, freed = 0;
+	struct kmag *km;
+
+	for (i=0; i<NSIZES; i++) {
+		km = &kc->kc_mags[i];
+		do {
+			spinlock_acquire(&kc->kc_lock);
+			for (n = 0; n < KMAG_BATCH && km->km_count > 0; n++) {
+				blocks[n] = km->km_blocks[--km->km_count];
+			}
+			spinlock_release(&kc->kc_lock);
+			freed += subpage_putblocks(blocks, n);
+		} while (n == KMAG_BATCH);
+	}
+	return freed;
+}
+
+/*
+ * Count the blocks sitting in all cpus' magazines, and how many bytes
+ * that is.
+ */
+static
+unsigned
+kmag_count(size_t *bytes)
+{
+	struct kmalloc_cpucache *kc;
+	unsigned j, nblocks = 0;
+
+	*bytes = 0;
+	spinlock_acquire(&kmalloc_spinlock);
+	for (kc = kmag_allcaches; kc != NULL; kc = kc->kc_next) {
+		for (j=0; j<NSIZES; j++) {
+			nblocks += kc->kc_mags[j].km_count;
+			*bytes += kc->kc_mags[j].km_count * sizes[j];
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+	return nblocks;
+}
+
+static
+unsigned
+kmag_shrink_count(void *data)
+{
+	size_t bytes;
+
+	(void)data;
+	kmag_count(&bytes);
+	return DIVROUNDUP(bytes, PAGE_SIZE);
+}
+
+/*
+ * Flush every cpu's magazines. This only frees pages whose other
+ * blocks are all free, so it doesn't try to stop at NPAGES.
+ */
+static
+unsigned
+kmag_shrink_scan(void *data, unsigned npages)
+{
+	struct kmalloc_cpucache *kc;
+	unsigned freed = 0;
+
+	(void)data;
+	(void)npages;
+
+	/* The list only ever grows at the head, so walk it unlocked. */
+	spinlock_acquire(&kmalloc_spinlock);
+	kc = kmag_allcaches;
+	spinlock_release(&kmalloc_spinlock);
+
+	for (; kc != NULL; kc = kc->kc_next) {
+		freed += kmag_drain(kc);
+	}
+	return freed;
+}
+
+static struct shrinker kmag_shrinker = {
+	.sh_name = "kmalloc",
+	.sh_count = kmag_shrink_count,
+	.sh_scan = kmag_shrink_scan,
+	.sh_data = NULL,
+};
+
+//
+////////////////////////////////////////////////////////////
+//
+// Heap profiler.
+//
+//    When turned on, every kmalloc records the block's address, size
+//    and call site in a table of live allocations, and per-site totals
+//    are kept so we can see who is using the heap. kfree drops the
+//    block from the table. Blocks allocated while profiling was off
+//    aren't in the table and are ignored when freed.
+//
+//    The tables are allocated with alloc_kpages when profiling is
+//    turned on and freed when it is turned off, so there is no cost
+//    beyond one flag test while it's off.
+//
+
+/* Number of call sites and live blocks we can track. */
+#define KPROF_NSITES    128
+#define KPROF_NLIVE     1024
+#define KPROF_HASHSIZE  256
+#define KPROF_NONE      0xffff
+
+/* Number of sites to print in each list. */
+#define KPROF_TOP       10
+
+struct kprof_site {
+	vaddr_t ks_caller;		/* return address into the caller */
+	unsigned ks_livecount;		/* blocks currently allocated */
+	size_t ks_livebytes;
+	unsigned ks_totalcount;		/* blocks ever allocated */
+	size_t ks_totalbytes;
+};
+
+struct kprof_live {
+	vaddr_t kl_ptr;
+	uint32_t kl_size;
+	uint16_t kl_site;
+	uint16_t kl_next;		/* hash chain or free list */
+};
+
+struct kprof_table {
+	struct kprof_site kt_sites[KPROF_NSITES];
+	unsigned kt_nsites;
+	struct kprof_live kt_live[KPROF_NLIVE];
+	uint16_t kt_hash[KPROF_HASHSIZE];
+	uint16_t kt_freelive;
+
+	/* Counters since profiling was turned on */
+	unsigned kt_nallocs;
+	unsigned kt_nfrees;
+	size_t kt_allocbytes;
+	unsigned kt_dropped;		/* allocations we had no room for */
+	time_t kt_startsecs;
+	uint32_t kt_startnsecs;
+};
+
+#define KPROF_NPAGES DIVROUNDUP(sizeof(struct kprof_table), PAGE_SIZE)
+
+static struct spinlock kprof_lock = SPINLOCK_INITIALIZER;
+static struct kprof_table *kprof;
+static volatile bool kheap_profiling;
+
+static
+unsigned
+kprof_hash(vaddr_t ptr)
+{
+	return (ptr >> 4) % KPROF_HASHSIZE;
+}
+
+/*
+ * Find or add the site for CALLER. Returns KPROF_NONE if the site
+ * table is full.
+ */
+static
+unsigned
+kprof_getsite(vaddr_t caller)
+{
+	unsigned i;
+
+	for (i=0; i<kprof->kt_nsites; i++) {
+		if (kprof->kt_sites[i].ks_caller == caller) {
+			return i;
+		}
+	}
+	if (kprof->kt_nsites == KPROF_NSITES) {
+		return KPROF_NONE;
+	}
+	i = kprof->kt_nsites++;
+	kprof->kt_sites[i].ks_caller = caller;
+	kprof->kt_sites[i].ks_livecount = 0;
+	kprof->kt_sites[i].ks_livebytes = 0;
+	kprof->kt_sites[i].ks_totalcount = 0;
+	kprof->kt_sites[i].ks_totalbytes = 0;
+	return i;
+}
+
+static
+void
+kprof_alloc(void *ptr, size_t sz, vaddr_t caller)
+{
+	struct kprof_live *kl;
+	struct kprof_site *ks;
+	unsigned site, ix, h;
+
+	spinlock_acquire(&kprof_lock);
+	if (kprof == NULL) {
+		spinlock_release(&kprof_lock);
+		return;
+	}
+	kprof->kt_nallocs++;
+	kprof->kt_allocbytes += sz;
+
+	site = kprof_getsite(caller);
+	ix = kprof->kt_freelive;
+	if (site == KPROF_NONE || ix == KPROF_NONE) {
+		kprof->kt_dropped++;
+		spinlock_release(&kprof_lock);
+		return;
+	}
+
+	ks = &kprof->kt_sites[site];
+	ks->ks_livecount++;
+	ks->ks_livebytes += sz;
+	ks->ks_totalcount++;
+	ks->ks_totalbytes += sz;
+
+	kl = &kprof->kt_live[ix];
+	kprof->kt_freelive = kl->kl_next;
+	h = kprof_hash((vaddr_t)ptr);
+	kl->kl_ptr = (vaddr_t)ptr;
+	kl->kl_size = sz;
+	kl->kl_site = site;
+	kl->kl_next = kprof->kt_hash[h];
+	kprof->kt_hash[h] = ix;
+	spinlock_release(&kprof_lock);
+}
+
+static
+void
+kprof_free(void *ptr)
+{
+	struct kprof_live *kl;
+	struct kprof_site *ks;
+	uint16_t *ixp, ix;
+
+	spinlock_acquire(&kprof_lock);
+	if (kprof == NULL) {
+		spinlock_release(&kprof_lock);
+		return;
+	}
+	kprof->kt_nfrees++;
+
+	for (ixp = &kprof->kt_hash[kprof_hash((vaddr_t)ptr)];
+	     *ixp != KPROF_NONE; ixp = &kl->kl_next) {
+		kl = &kprof->kt_live[*ixp];
+		if (kl->kl_ptr == (vaddr_t)ptr) {
+			ks = &kprof->kt_sites[kl->kl_site];
+			KASSERT(ks->ks_livecount > 0);
+			ks->ks_livecount--;
+			ks->ks_livebytes -= kl->kl_size;
+
+			ix = *ixp;
+			*ixp = kl->kl_next;
+			kl->kl_next = kprof->kt_freelive;
+			kprof->kt_freelive = ix;
+			break;
+		}
+	}
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * Turn profiling on, or restart it with empty tables if it's on
+ * already.
+ */
+int
+kheap_profile_start(void)
+{
+	struct kprof_table *kt, *old;
+	vaddr_t addr;
+	unsigned i;
+
+	addr = alloc_kpages(KPROF_NPAGES);
+	if (addr == 0) {
+		return ENOMEM;
+	}
+	kt = (struct kprof_table *)addr;
+
+	kt->kt_nsites = 0;
+	for (i=0; i<KPROF_NLIVE; i++) {
+		kt->kt_live[i].kl_next = (i+1 < KPROF_NLIVE) ? i+1 : KPROF_NONE;
+	}
+	kt->kt_freelive = 0;
+	for (i=0; i<KPROF_HASHSIZE; i++) {
+		kt->kt_hash[i] = KPROF_NONE;
+	}
+	kt->kt_nallocs = kt->kt_nfrees = kt->kt_dropped = 0;
+	kt->kt_allocbytes = 0;
+	gettime(&kt->kt_startsecs, &kt->kt_startnsecs);
+
+	spinlock_acquire(&kprof_lock);
+	old = kprof;
+	kprof = kt;
+	kheap_profiling = true;
+	spinlock_release(&kprof_lock);
+
+	if (old != NULL) {
+		free_kpages((vaddr_t)old);
+	}
 	return 0;
 }
 
+void
+kheap_profile_stop(void)
+{
+	struct kprof_table *old;
+
+	spinlock_acquire(&kprof_lock);
+	kheap_profiling = false;
+	old = kprof;
+	kprof = NULL;
+	spinlock_release(&kprof_lock);
+
+	if (old != NULL) {
+		free_kpages((vaddr_t)old);
+	}
+}
+
+/*
+ * Print the KPROF_TOP sites with the most live bytes (BYBYTES) or
+ * the most live blocks. Call with kprof_lock held.
+ */
+static
+void
+kprof_printtop(bool bybytes)
+{
+	bool printed[KPROF_NSITES];
+	struct kprof_site *ks, *best;
+	unsigned i, n, besti;
+
+	for (i=0; i<kprof->kt_nsites; i++) {
+		printed[i] = false;
+	}
+
+	kprintf("Top call sites by live %s:\n", bybytes ? "bytes" : "blocks");
+	kprintf("    %-10s %8s %10s %8s %10s\n", "caller", "blocks",
+		"bytes", "total", "totalbytes");
+	for (n=0; n<KPROF_TOP; n++) {
+		best = NULL;
+		besti = 0;
+		for (i=0; i<kprof->kt_nsites; i++) {
+			ks = &kprof->kt_sites[i];
+			if (printed[i]) {
+				continue;
+			}
+			if (best == NULL ||
+			    (bybytes ? ks->ks_livebytes > best->ks_livebytes
+			     : ks->ks_livecount > best->ks_livecount)) {
+				best = ks;
+				besti = i;
+			}
+		}
+		if (best == NULL || best->ks_livecount == 0) {
+			break;
+		}
+		printed[besti] = true;
+		kprintf("    0x%08lx %8u %10lu %8u %10lu\n",
+			(unsigned long)best->ks_caller,
+			best->ks_livecount, (unsigned long)best->ks_livebytes,
+			best->ks_totalcount,
+			(unsigned long)best->ks_totalbytes);
+	}
+}
+
+void
+kheap_profile_dump(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+	unsigned ms;
+
+	gettime(&secs, &nsecs);
+
+	/* print the whole thing with interrupts off */
+	spinlock_acquire(&kprof_lock);
+	if (kprof == NULL) {
+		spinlock_release(&kprof_lock);
+		kprintf("Heap profiling is off\n");
+		return;
+	}
+
+	ms = (secs - kprof->kt_startsecs) * 1000;
+	ms += nsecs / 1000000;
+	ms -= kprof->kt_startnsecs / 1000000;
+	if (ms == 0) {
+		ms = 1;
+	}
+
+	kprintf("Heap profile for the last %u.%03u seconds:\n",
+		ms / 1000, ms % 1000);
+	kprintf("    %u allocs (%u/sec), %u frees (%u/sec), "
+		"%lu bytes allocated (%lu/sec)\n",
+		kprof->kt_nallocs, kprof->kt_nallocs * 1000 / ms,
+		kprof->kt_nfrees, kprof->kt_nfrees * 1000 / ms,
+		(unsigned long)kprof->kt_allocbytes,
+		(unsigned long)(kprof->kt_allocbytes / ms * 1000));
+	kprintf("    %u call sites, %u allocations not tracked\n",
+		kprof->kt_nsites, kprof->kt_dropped);
+
+	kprof_printtop(true);
+	kprof_printtop(false);
+
+	spinlock_release(&kprof_lock);
+}
+
 //
 ////////////////////////////////////////////////////////////
 
 void *
 kmalloc(size_t sz)
 {
+	void *ptr;
+
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
@@ -608,24 +1454,44 @@ kmalloc(size_t sz)
 		/* Round up to a whole number of pages. */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
 		address = alloc_kpages(npages);
-		if (address==0) {
-			return NULL;
-		}
-
-		return (void *)address;
+		ptr = (void *)address;
+	}
+	/* The magazines need the page owners to put blocks back. */
+	else if (kheap_pageowners) {
+		ptr = kmag_alloc(sz);
+	}
+	else {
+		ptr = subpage_kmalloc(sz);
 	}
 
-	return subpage_kmalloc(sz);
+	if (kheap_profiling && ptr != NULL) {
+		kprof_alloc(ptr, sz, (vaddr_t)__builtin_return_address(0));
+	}
+	return ptr;
 }
 
 void
 kfree(void *ptr)
 {
+	if (kheap_profiling && ptr != NULL) {
+		kprof_free(ptr);
+	}
+
 	/*
 	 * Try subpage first; if that fails, assume it's a big allocation.
 	 */
 	if (ptr == NULL) {
 		return;
+	} else if (kheap_pageowners) {
+		struct pageref *pr = subpage_lookup(ptr);
+
+		if (pr != NULL) {
+			kmag_free(pr, ptr);
+		}
+		else {
+			KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
+			free_kpages((vaddr_t)ptr);
+		}
 	} else if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
@@ -0,0 +1,425 @@
+/*
+ * Typed object caches. See objcache.h for the interface.
+ *
+ * Every slab is a single page from alloc_kpages, so the slab an
+ * object belongs to is found by masking its address. The page starts
+ * with the slab header, then a stack of free object indexes, then the
+ * objects themselves. Keeping the free list outside the objects is
+ * what lets free objects stay constructed.
+ *
+ * Each cache has its own spinlock, which is never held across calls
+ * to the constructor, the destructor or the page allocator. The list
+ * of caches is protected by oc_listlock; the shrinker holds it while
+ * it destroys slabs so that a cache cannot go away underneath it.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <shrinker.h>
+#include <objcache.h>
+
+/* Alignment of objects within a slab. */
+#define OC_ALIGN     8
+
+/* Number of empty slabs a cache keeps before freeing them eagerly. */
+#define OC_MAXEMPTY  2
+
+struct objslab {
+	struct objcache *os_cache;
+	struct objslab *os_prev;
+	struct objslab *os_next;
+	unsigned os_nfree;
+	uint16_t os_free[];		/* stack of free object indexes */
+};
+
+struct objcache {
+	char *oc_name;
+	size_t oc_size;			/* object size, rounded to OC_ALIGN */
+	size_t oc_offset;		/* offset of the first object in a slab */
+	unsigned oc_perslab;		/* objects per slab */
+	int (*oc_ctor)(void *obj);
+	void (*oc_dtor)(void *obj);
+
+	struct spinlock oc_lock;
+	struct objslab *oc_partial;	/* slabs with some objects free */
+	struct objslab *oc_full;	/* slabs with no objects free */
+	struct objslab *oc_empty;	/* slabs with every object free */
+	unsigned oc_nslabs;
+	unsigned oc_nempty;
+	unsigned oc_inuse;		/* objects handed out */
+
+	struct objcache *oc_next;	/* protected by oc_listlock */
+};
+
+static struct spinlock oc_listlock = SPINLOCK_INITIALIZER;
+static struct objcache *oc_caches;
+
+////////////////////////////////////////////////////////////
+//
+// Slabs
+
+static
+void
+objslab_insert(struct objslab **head, struct objslab *os)
+{
+	os->os_prev = NULL;
+	os->os_next = *head;
+	if (*head != NULL) {
+		(*head)->os_prev = os;
+	}
+	*head = os;
+}
+
+static
+void
+objslab_remove(struct objslab **head, struct objslab *os)
+{
+	if (os->os_prev != NULL) {
+		os->os_prev->os_next = os->os_next;
+	}
+	else {
+		KASSERT(*head == os);
+		*head = os->os_next;
+	}
+	if (os->os_next != NULL) {
+		os->os_next->os_prev = os->os_prev;
+	}
+	os->os_prev = os->os_next = NULL;
+}
+
+static
+void *
+objslab_obj(struct objcache *oc, struct objslab *os, unsigned index)
+{
+	return (char *)os + oc->oc_offset + index * oc->oc_size;
+}
+
+/*
+ * Get a page and construct every object in it. Call without oc_lock.
+ */
+static
+struct objslab *
+objslab_create(struct objcache *oc)
+{
+	struct objslab *os;
+	vaddr_t page;
+	unsigned i;
+	int result;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+	os = (struct objslab *)page;
+	os->os_cache = oc;
+	os->os_prev = os->os_next = NULL;
+
+	if (oc->oc_ctor != NULL) {
+		for (i=0; i<oc->oc_perslab; i++) {
+			result = oc->oc_ctor(objslab_obj(oc, os, i));
+			if (result) {
+				while (oc->oc_dtor != NULL && i > 0) {
+					i--;
+					oc->oc_dtor(objslab_obj(oc, os, i));
+				}
+				free_kpages(page);
+				return NULL;
+			}
+		}
+	}
+
+	/* Hand out the lowest addresses first. */
+	for (i=0; i<oc->oc_perslab; i++) {
+		os->os_free[i] = oc->oc_perslab - 1 - i;
+	}
+	os->os_nfree = oc->oc_perslab;
+	return os;
+}
+
+/*
+ * Destruct every object in an unlinked, empty slab and free its page.
+ * Call without oc_lock.
+ */
+static
+void
+objslab_destroy(struct objcache *oc, struct objslab *os)
+{
+	unsigned i;
+
+	KASSERT(os->os_cache == oc);
+	KASSERT(os->os_nfree == oc->oc_perslab);
+
+	if (oc->oc_dtor != NULL) {
+		for (i=0; i<oc->oc_perslab; i++) {
+			oc->oc_dtor(objslab_obj(oc, os, i));
+		}
+	}
+	os->os_cache = NULL;
+	free_kpages((vaddr_t)os);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Shrinker
+
+static
+unsigned
+oc_shrink_count(void *data)
+{
+	struct objcache *oc;
+	unsigned count = 0;
+
+	(void)data;
+
+	spinlock_acquire(&oc_listlock);
+	for (oc = oc_caches; oc != NULL; oc = oc->oc_next) {
+		count += oc->oc_nempty;
+	}
+	spinlock_release(&oc_listlock);
+
+	return count;
+}
+
+/*
+ * Free up to NPAGES empty slabs, taking them from each cache in turn.
+ */
+static
+unsigned
+oc_shrink_scan(void *data, unsigned npages)
+{
+	struct objcache *oc;
+	struct objslab *os, *list;
+	unsigned freed = 0;
+
+	(void)data;
+
+	spinlock_acquire(&oc_listlock);
+	for (oc = oc_caches; oc != NULL && freed < npages; oc = oc->oc_next) {
+		list = NULL;
+		spinlock_acquire(&oc->oc_lock);
+		while (oc->oc_empty != NULL && freed < npages) {
+			os = oc->oc_empty;
+			objslab_remove(&oc->oc_empty, os);
+			oc->oc_nempty--;
+			oc->oc_nslabs--;
+			os->os_next = list;
+			list = os;
+			freed++;
+		}
+		spinlock_release(&oc->oc_lock);
+
+		while (list != NULL) {
+			os = list;
+			list = os->os_next;
+			objslab_destroy(oc, os);
+		}
+	}
+	spinlock_release(&oc_listlock);
+
+	return freed;
+}
+
+static struct shrinker oc_shrinker = {
+	.sh_name = "objcache",
+	.sh_count = oc_shrink_count,
+	.sh_scan = oc_shrink_scan,
+	.sh_data = NULL,
+};
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+void
+objcache_bootstrap(void)
+{
+	oc_caches = NULL;
+	shrinker_register(&oc_shrinker);
+}
+
+struct objcache *
+objcache_create(const char *name, size_t size,
+		int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct objcache *oc;
+	size_t header;
+	unsigned perslab;
+
+	KASSERT(size > 0);
+
+	size = ROUNDUP(size, OC_ALIGN);
+
+	/*
+	 * Fit as many objects as possible after the slab header and
+	 * one free-stack entry per object.
+	 */
+	perslab = (PAGE_SIZE - sizeof(struct objslab)) /
+		(size + sizeof(uint16_t));
+	while (perslab > 0) {
+		header = sizeof(struct objslab) + perslab * sizeof(uint16_t);
+		header = ROUNDUP(header, OC_ALIGN);
+		if (header + perslab * size <= PAGE_SIZE) {
+			break;
+		}
+		perslab--;
+	}
+	if (perslab == 0) {
+		return NULL;
+	}
+
+	oc = kmalloc(sizeof(*oc));
+	if (oc == NULL) {
+		return NULL;
+	}
+	oc->oc_name = kstrdup(name);
+	if (oc->oc_name == NULL) {
+		kfree(oc);
+		return NULL;
+	}
+	oc->oc_size = size;
+	oc->oc_offset = header;
+	oc->oc_perslab = perslab;
+	oc->oc_ctor = ctor;
+	oc->oc_dtor = dtor;
+
+	spinlock_init(&oc->oc_lock);
+	oc->oc_partial = oc->oc_full = oc->oc_empty = NULL;
+	oc->oc_nslabs = oc->oc_nempty = oc->oc_inuse = 0;
+
+	spinlock_acquire(&oc_listlock);
+	oc->oc_next = oc_caches;
+	oc_caches = oc;
+	spinlock_release(&oc_listlock);
+
+	return oc;
+}
+
+/*
+ * Destroy a cache. Every object must have been freed.
+ */
+void
+objcache_destroy(struct objcache *oc)
+{
+	struct objcache **ptr;
+	struct objslab *os;
+
+	spinlock_acquire(&oc_listlock);
+	for (ptr = &oc_caches; *ptr != oc; ptr = &(*ptr)->oc_next) {
+		KASSERT(*ptr != NULL);
+	}
+	*ptr = oc->oc_next;
+	oc->oc_next = NULL;
+	spinlock_release(&oc_listlock);
+
+	KASSERT(oc->oc_inuse == 0);
+	KASSERT(oc->oc_partial == NULL);
+	KASSERT(oc->oc_full == NULL);
+
+	while (oc->oc_empty != NULL) {
+		os = oc->oc_empty;
+		objslab_remove(&oc->oc_empty, os);
+		objslab_destroy(oc, os);
+	}
+
+	spinlock_cleanup(&oc->oc_lock);
+	kfree(oc->oc_name);
+	kfree(oc);
+}
+
+void *
+objcache_alloc(struct objcache *oc)
+{
+	struct objslab *os;
+	void *obj;
+
+	spinlock_acquire(&oc->oc_lock);
+	if (oc->oc_partial == NULL && oc->oc_empty == NULL) {
+		spinlock_release(&oc->oc_lock);
+		os = objslab_create(oc);
+		if (os == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&oc->oc_lock);
+		objslab_insert(&oc->oc_empty, os);
+		oc->oc_nslabs++;
+		oc->oc_nempty++;
+	}
+
+	/* Prefer partly used slabs so that empty ones can be freed. */
+	os = oc->oc_partial;
+	if (os == NULL) {
+		os = oc->oc_empty;
+		objslab_remove(&oc->oc_empty, os);
+		oc->oc_nempty--;
+		objslab_insert(&oc->oc_partial, os);
+	}
+
+	KASSERT(os->os_nfree > 0);
+	os->os_nfree--;
+	obj = objslab_obj(oc, os, os->os_free[os->os_nfree]);
+	if (os->os_nfree == 0) {
+		objslab_remove(&oc->oc_partial, os);
+		objslab_insert(&oc->oc_full, os);
+	}
+	oc->oc_inuse++;
+	spinlock_release(&oc->oc_lock);
+
+	return obj;
+}
+
+void
+objcache_free(struct objcache *oc, void *obj)
+{
+	struct objslab *os, *dead = NULL;
+	unsigned index;
+
+	os = (struct objslab *)((vaddr_t)obj & PAGE_FRAME);
+	KASSERT(os->os_cache == oc);
+	index = ((vaddr_t)obj - (vaddr_t)os - oc->oc_offset) / oc->oc_size;
+	KASSERT(index < oc->oc_perslab);
+	KASSERT(objslab_obj(oc, os, index) == obj);
+
+	spinlock_acquire(&oc->oc_lock);
+	KASSERT(os->os_nfree < oc->oc_perslab);
+	if (os->os_nfree == 0) {
+		objslab_remove(&oc->oc_full, os);
+		objslab_insert(&oc->oc_partial, os);
+	}
+	os->os_free[os->os_nfree++] = index;
+	oc->oc_inuse--;
+
+	if (os->os_nfree == oc->oc_perslab) {
+		objslab_remove(&oc->oc_partial, os);
+		if (oc->oc_nempty < OC_MAXEMPTY) {
+			objslab_insert(&oc->oc_empty, os);
+			oc->oc_nempty++;
+		}
+		else {
+			oc->oc_nslabs--;
+			dead = os;
+		}
+	}
+	spinlock_release(&oc->oc_lock);
+
+	if (dead != NULL) {
+		objslab_destroy(oc, dead);
+	}
+}
+
+void
+objcache_printstats(void)
+{
+	struct objcache *oc;
+
+	spinlock_acquire(&oc_listlock);
+	for (oc = oc_caches; oc != NULL; oc = oc->oc_next) {
+		kprintf("%-12s %4lu bytes, %3u/slab: %u in use, "
+			"%u slabs (%u empty)\n",
+			oc->oc_name, (unsigned long)oc->oc_size,
+			oc->oc_perslab, oc->oc_inuse,
+			oc->oc_nslabs, oc->oc_nempty);
+	}
+	spinlock_release(&oc_listlock);
+}
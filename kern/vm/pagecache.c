@@ -0,0 +1,393 @@
+/*
+ * Unified page cache. See pagecache.h for the interface.
+ *
+ * Pages live in a hash table keyed by (vnode, offset) and on a single
+ * LRU list. Everything is protected by pc_lock, which is a spinlock
+ * so that the cache's shrinker can run from getppages.
+ * pc_lock is never held while calling into kmalloc or the coremap;
+ * pages are unlinked under the lock and freed after dropping it.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <shrinker.h>
+#include <pageout.h>
+#include <pagecache.h>
+
+/* Number of hash buckets. */
+#define PC_HASHSIZE  256
+
+static struct spinlock pc_lock = SPINLOCK_INITIALIZER;
+static struct pcpage *pc_hash[PC_HASHSIZE];
+static struct pcpage *pc_lruhead;
+static struct pcpage *pc_lrutail;
+
+/* Statistics, protected by pc_lock. */
+static unsigned pc_npages;
+static unsigned pc_hits;
+static unsigned pc_misses;
+static unsigned pc_evictions;
+
+static
+unsigned
+pc_hashfunc(struct vnode *v, off_t offset)
+{
+	uint32_t h;
+
+	h = (uint32_t)(uintptr_t)v >> 4;
+	h ^= (uint32_t)(offset / PAGE_SIZE) * 2654435761U;
+	return h % PC_HASHSIZE;
+}
+
+////////////////////////////////////////////////////////////
+//
+// List manipulation. All of these require pc_lock.
+
+static
+void
+pc_lru_remove(struct pcpage *pp)
+{
+	if (pp->pp_lruprev != NULL) {
+		pp->pp_lruprev->pp_lrunext = pp->pp_lrunext;
+	}
+	else {
+		KASSERT(pc_lruhead == pp);
+		pc_lruhead = pp->pp_lrunext;
+	}
+	if (pp->pp_lrunext != NULL) {
+		pp->pp_lrunext->pp_lruprev = pp->pp_lruprev;
+	}
+	else {
+		KASSERT(pc_lrutail == pp);
+		pc_lrutail = pp->pp_lruprev;
+	}
+	pp->pp_lruprev = pp->pp_lrunext = NULL;
+}
+
+static
+void
+pc_lru_addhead(struct pcpage *pp)
+{
+	pp->pp_lruprev = NULL;
+	pp->pp_lrunext = pc_lruhead;
+	if (pc_lruhead != NULL) {
+		pc_lruhead->pp_lruprev = pp;
+	}
+	else {
+		pc_lrutail = pp;
+	}
+	pc_lruhead = pp;
+}
+
+static
+struct pcpage *
+pc_lookup(struct vnode *v, off_t offset)
+{
+	struct pcpage *pp;
+
+	for (pp = pc_hash[pc_hashfunc(v, offset)]; pp != NULL;
+	     pp = pp->pp_hashnext) {
+		if (pp->pp_vnode == v && pp->pp_offset == offset) {
+			return pp;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+pc_insert(struct pcpage *pp)
+{
+	unsigned h = pc_hashfunc(pp->pp_vnode, pp->pp_offset);
+
+	pp->pp_hashnext = pc_hash[h];
+	pc_hash[h] = pp;
+	pc_lru_addhead(pp);
+	pc_npages++;
+}
+
+/*
+ * Take a page out of the hash table and the LRU list.
+ */
+static
+void
+pc_unlink(struct pcpage *pp)
+{
+	struct pcpage **ptr;
+
+	ptr = &pc_hash[pc_hashfunc(pp->pp_vnode, pp->pp_offset)];
+	while (*ptr != pp) {
+		KASSERT(*ptr != NULL);
+		ptr = &(*ptr)->pp_hashnext;
+	}
+	*ptr = pp->pp_hashnext;
+	pp->pp_hashnext = NULL;
+
+	pc_lru_remove(pp);
+	pc_npages--;
+}
+
+/*
+ * Unlink the least recently used unpinned page, if there is one.
+ */
+static
+struct pcpage *
+pc_evict(void)
+{
+	struct pcpage *pp;
+
+	for (pp = pc_lrutail; pp != NULL; pp = pp->pp_lruprev) {
+		if (pp->pp_pincount == 0) {
+			pc_unlink(pp);
+			pc_evictions++;
+			return pp;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Free a page that has already been unlinked. Call without pc_lock.
+ */
+static
+void
+pc_free(struct pcpage *pp)
+{
+	free_kpages(pp->pp_kva);
+	kfree(pp);
+}
+
+/*
+ * Free a list of unlinked pages chained through pp_hashnext.
+ */
+static
+void
+pc_freelist(struct pcpage *list)
+{
+	struct pcpage *pp;
+
+	while (list != NULL) {
+		pp = list;
+		list = pp->pp_hashnext;
+		pc_free(pp);
+	}
+}
+
+static unsigned pc_shrink_count(void *data);
+static unsigned pc_shrink_scan(void *data, unsigned npages);
+
+static struct shrinker pc_shrinker = {
+	.sh_name = "pagecache",
+	.sh_count = pc_shrink_count,
+	.sh_scan = pc_shrink_scan,
+	.sh_data = NULL,
+};
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+void
+pagecache_bootstrap(void)
+{
+	unsigned i;
+
+	spinlock_init(&pc_lock);
+	for (i=0; i<PC_HASHSIZE; i++) {
+		pc_hash[i] = NULL;
+	}
+	pc_lruhead = pc_lrutail = NULL;
+	pc_npages = pc_hits = pc_misses = pc_evictions = 0;
+
+	shrinker_register(&pc_shrinker);
+}
+
+struct pcpage *
+pagecache_get(struct vnode *v, off_t offset)
+{
+	struct pcpage *pp, *newpp, *old;
+	vaddr_t kva;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	spinlock_acquire(&pc_lock);
+	pp = pc_lookup(v, offset);
+	if (pp != NULL) {
+		pp->pp_pincount++;
+		pc_lru_remove(pp);
+		pc_lru_addhead(pp);
+		pc_hits++;
+		spinlock_release(&pc_lock);
+		return pp;
+	}
+	pc_misses++;
+	spinlock_release(&pc_lock);
+
+	newpp = kmalloc(sizeof(*newpp));
+	if (newpp == NULL) {
+		return NULL;
+	}
+
+	/*
+	 * Grow into free memory if there's plenty; otherwise recycle
+	 * our own least recently used page. Stopping at the page-out
+	 * daemon's high watermark means the cache filling up never
+	 * wakes the daemon just to shrink it again.
+	 */
+	kva = 0;
+	if (vm_freepages() > pageout_highwater) {
+		kva = alloc_kpages(1);
+	}
+	if (kva == 0) {
+		spinlock_acquire(&pc_lock);
+		old = pc_evict();
+		spinlock_release(&pc_lock);
+		if (old == NULL) {
+			kfree(newpp);
+			return NULL;
+		}
+		kva = old->pp_kva;
+		kfree(old);
+	}
+
+	newpp->pp_vnode = v;
+	newpp->pp_offset = offset;
+	newpp->pp_kva = kva;
+	newpp->pp_pincount = 1;
+	newpp->pp_valid = false;
+	newpp->pp_orphan = false;
+	newpp->pp_hashnext = NULL;
+	newpp->pp_lruprev = newpp->pp_lrunext = NULL;
+	kpage_setowner(kva, newpp);
+
+	spinlock_acquire(&pc_lock);
+	pp = pc_lookup(v, offset);
+	if (pp != NULL) {
+		/* Someone else got there first; use theirs. */
+		pp->pp_pincount++;
+		spinlock_release(&pc_lock);
+		pc_free(newpp);
+		return pp;
+	}
+	pc_insert(newpp);
+	spinlock_release(&pc_lock);
+
+	return newpp;
+}
+
+void
+pagecache_release(struct pcpage *pp, bool ok)
+{
+	bool dofree;
+
+	spinlock_acquire(&pc_lock);
+	KASSERT(pp->pp_pincount > 0);
+	if (ok) {
+		pp->pp_valid = true;
+	}
+	else if (!pp->pp_orphan) {
+		pc_unlink(pp);
+		pp->pp_orphan = true;
+	}
+	pp->pp_pincount--;
+	dofree = pp->pp_orphan && pp->pp_pincount == 0;
+	spinlock_release(&pc_lock);
+
+	if (dofree) {
+		pc_free(pp);
+	}
+}
+
+void
+pagecache_invalidate(struct vnode *v, off_t from)
+{
+	struct pcpage *pp, *next, *list = NULL;
+
+	spinlock_acquire(&pc_lock);
+	for (pp = pc_lruhead; pp != NULL; pp = next) {
+		next = pp->pp_lrunext;
+		if (pp->pp_vnode != v || pp->pp_offset + PAGE_SIZE <= from) {
+			continue;
+		}
+		pc_unlink(pp);
+		if (pp->pp_pincount > 0) {
+			/* Freed by the last pagecache_release. */
+			pp->pp_orphan = true;
+		}
+		else {
+			pp->pp_hashnext = list;
+			list = pp;
+		}
+	}
+	spinlock_release(&pc_lock);
+
+	pc_freelist(list);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Shrinker
+
+static
+unsigned
+pc_shrink_count(void *data)
+{
+	unsigned npages;
+
+	(void)data;
+
+	spinlock_acquire(&pc_lock);
+	npages = pc_npages;
+	spinlock_release(&pc_lock);
+
+	return npages;
+}
+
+/*
+ * Give up to NPAGES unpinned pages back to the VM system, least
+ * recently used first.
+ */
+static
+unsigned
+pc_shrink_scan(void *data, unsigned npages)
+{
+	struct pcpage *pp, *list = NULL;
+	unsigned count = 0;
+
+	(void)data;
+
+	spinlock_acquire(&pc_lock);
+	while (count < npages) {
+		pp = pc_evict();
+		if (pp == NULL) {
+			break;
+		}
+		pp->pp_hashnext = list;
+		list = pp;
+		count++;
+	}
+	spinlock_release(&pc_lock);
+
+	pc_freelist(list);
+	return count;
+}
+
+void
+pagecache_printstats(void)
+{
+	unsigned npages, hits, misses, evictions;
+
+	spinlock_acquire(&pc_lock);
+	npages = pc_npages;
+	hits = pc_hits;
+	misses = pc_misses;
+	evictions = pc_evictions;
+	spinlock_release(&pc_lock);
+
+	kprintf("Page cache: %u pages (%u bytes)\n", npages,
+		npages * PAGE_SIZE);
+	kprintf("    %u hits, %u misses, %u evictions\n",
+		hits, misses, evictions);
+}
@@ -0,0 +1,139 @@
+/*
+ * Page-out daemon. See pageout.h.
+ *
+ * There is no swap, and cached file pages are never dirty, so "paging
+ * out" amounts to running the shrinkers. The daemon does that in
+ * small batches so the caches aren't locked up for long at a time.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <thread.h>
+#include <wchan.h>
+#include <vm.h>
+#include <shrinker.h>
+#include <pageout.h>
+#include <workqueue.h>
+
+/* Pages to ask for per shrink_caches call */
+#define PAGEOUT_BATCH  8
+
+unsigned pageout_lowwater = 16;
+unsigned pageout_highwater = 32;
+
+static struct wchan *pageout_wchan;
+
+/* True while the daemon is reclaiming; saves needless wakeups. */
+static volatile bool pageout_running;
+
+/* Statistics (only updated by the daemon itself) */
+static unsigned pageout_wakeups;
+static unsigned pageout_freed;
+
+static
+void
+pageout_thread(void *data1, unsigned long data2)
+{
+	unsigned nfree, want, got;
+	bool stuck = false, flushed;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		/*
+		 * Sleep until memory runs low. If the last pass couldn't
+		 * free anything, sleep regardless so as not to spin; the
+		 * next allocation will wake us to try again.
+		 */
+		wchan_lock(pageout_wchan);
+		if (stuck || vm_freepages() >= pageout_lowwater) {
+			pageout_running = false;
+			wchan_sleep(pageout_wchan);
+		}
+		else {
+			wchan_unlock(pageout_wchan);
+		}
+		pageout_running = true;
+		pageout_wakeups++;
+		stuck = false;
+		flushed = false;
+
+		while ((nfree = vm_freepages()) < pageout_highwater) {
+			want = pageout_highwater - nfree;
+			if (want > PAGEOUT_BATCH) {
+				want = PAGEOUT_BATCH;
+			}
+			got = shrink_caches(want);
+			if (got == 0 && !flushed) {
+				/*
+				 * Exited processes' address spaces may
+				 * still be waiting to be freed; let
+				 * that happen and look again.
+				 */
+				workqueue_flush();
+				flushed = true;
+				continue;
+			}
+			if (got == 0) {
+				stuck = true;
+				break;
+			}
+			pageout_freed += got;
+		}
+	}
+}
+
+void
+pageout_bootstrap(void)
+{
+	int result;
+
+	pageout_wchan = wchan_create("pageout");
+	if (pageout_wchan == NULL) {
+		panic("pageout_bootstrap: Out of memory\n");
+	}
+
+	pageout_running = true;
+	/* Real-time, so that reclaim isn't held up by CPU hogs. */
+	result = thread_fork_rt("pageout", NULL, pageout_thread, NULL, 0);
+	if (result) {
+		panic("pageout_bootstrap: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+}
+
+void
+pageout_wakeup(void)
+{
+	if (pageout_wchan == NULL || pageout_running) {
+		return;
+	}
+	wchan_wakeone(pageout_wchan);
+}
+
+int
+pageout_setwatermarks(unsigned low, unsigned high)
+{
+	if (low >= high || high > vm_totalpages()) {
+		return EINVAL;
+	}
+	pageout_lowwater = low;
+	pageout_highwater = high;
+
+	/* Catch up with the new settings now, not at the next alloc. */
+	if (vm_freepages() < pageout_lowwater) {
+		pageout_wakeup();
+	}
+	return 0;
+}
+
+void
+pageout_printstats(void)
+{
+	kprintf("pageout: low watermark %u pages, high watermark %u pages\n",
+		pageout_lowwater, pageout_highwater);
+	kprintf("    %u free pages, woken %u times, %u pages freed\n",
+		vm_freepages(), pageout_wakeups, pageout_freed);
+}
@@ -0,0 +1,95 @@
+/*
+ * Memory-pressure callbacks. See shrinker.h.
+ *
+ * The list is protected by a spinlock, since shrink_caches is called
+ * from the page allocator. The lock is only held while walking the
+ * list, not across the callbacks, which can take a while: a shrinker
+ * is pinned with sh_busy while its callbacks run, and unregistering
+ * waits for that to drop to zero, so the shrinker and its place in
+ * the list stay put. If a callback ends up back in the page allocator
+ * anyway, the nested shrink_caches call sees the thread's t_inshrink
+ * and just returns 0 instead of recursing.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <current.h>
+#include <shrinker.h>
+
+static struct spinlock shrinker_lock = SPINLOCK_INITIALIZER;
+static struct shrinker *shrinkers;
+
+void
+shrinker_register(struct shrinker *sh)
+{
+	KASSERT(sh->sh_count != NULL);
+	KASSERT(sh->sh_scan != NULL);
+
+	sh->sh_busy = 0;
+
+	spinlock_acquire(&shrinker_lock);
+	sh->sh_next = shrinkers;
+	shrinkers = sh;
+	spinlock_release(&shrinker_lock);
+}
+
+void
+shrinker_unregister(struct shrinker *sh)
+{
+	struct shrinker **ptr;
+
+	KASSERT(!curthread->t_in_interrupt);
+
+	spinlock_acquire(&shrinker_lock);
+	while (sh->sh_busy > 0) {
+		spinlock_release(&shrinker_lock);
+		thread_yield();
+		spinlock_acquire(&shrinker_lock);
+	}
+	for (ptr = &shrinkers; *ptr != sh; ptr = &(*ptr)->sh_next) {
+		KASSERT(*ptr != NULL);
+	}
+	*ptr = sh->sh_next;
+	sh->sh_next = NULL;
+	spinlock_release(&shrinker_lock);
+}
+
+unsigned
+shrink_caches(unsigned npages)
+{
+	struct shrinker *sh, *next;
+	unsigned freed = 0;
+
+	if (!CURCPU_EXISTS()) {
+		/* Too early in boot for anything to be registered. */
+		return 0;
+	}
+	if (curthread->t_inshrink) {
+		/* Called back into from a shrinker; don't recurse. */
+		return 0;
+	}
+	curthread->t_inshrink = true;
+
+	spinlock_acquire(&shrinker_lock);
+	sh = shrinkers;
+	while (sh != NULL && freed < npages) {
+		sh->sh_busy++;
+		spinlock_release(&shrinker_lock);
+
+		if (sh->sh_count(sh->sh_data) > 0) {
+			freed += sh->sh_scan(sh->sh_data, npages - freed);
+		}
+
+		spinlock_acquire(&shrinker_lock);
+		next = sh->sh_next;
+		sh->sh_busy--;
+		sh = next;
+	}
+	spinlock_release(&shrinker_lock);
+
+	curthread->t_inshrink = false;
+
+	return freed;
+}
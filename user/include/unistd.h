@@ -42,6 +42,7 @@
 #include <kern/reboot.h>
 #include <kern/seek.h>
 #include <kern/time.h>
+#include <kern/resource.h>
 #include <kern/unistd.h>
 #include <kern/wait.h>
 
@@ -153,10 +154,25 @@ int readlink(const char *path, char *buf, size_t buflen);
 int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 time_t __time(time_t *seconds, unsigned long *nanoseconds);
+int nanosleep(const struct timespec *req, struct timespec *rem);
 int __getcwd(char *buf, size_t buflen);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
 
+/*
+ * CPU affinity: bit N of the mask set means the calling process may
+ * run on cpu N.
+ */
+int setaffinity(unsigned mask);
+int getaffinity(unsigned *mask);
+
+/*
+ * Fair-share priority (nice value) of a process; WHICH must be
+ * PRIO_PROCESS. Lower values get more of the cpu.
+ */
+int setpriority(int which, pid_t who, int prio);
+int getpriority(int which, pid_t who);
+
 /*
  * These are not themselves system calls, but wrapper routines in libc.
  */